@@ -0,0 +1,538 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "ddriver.h"
+
+/******************************************************************************
+* SECTION: ddriver替身，实现include/ddriver.h的接口，以普通文件模拟磁盘，
+* 用于没有课程ddriver库的环境。行为与ddriver一致：先seek到IO单位对齐的位置，
+* 每次read/write恰好一个IO单位，磁头随之后移。由环境变量配置：
+*   NEWFS_DDRIVER_BACKEND   file（pread/pwrite，默认）或mmap
+*   NEWFS_DDRIVER_SIZE      新建镜像的大小（字节，可带K/M/G后缀，默认4M）；已有镜像按文件大小。
+*                           设备大小超出int时IOC_REQ_DEVICE_SIZE失败（errno为EFBIG），
+*                           须用IOC_REQ_DEVICE_SIZE64查询
+*   NEWFS_DDRIVER_IO_SZ     IO单位（字节，默认512）
+*   NEWFS_DDRIVER_SEEK_US   每次移动磁头（目标不是当前位置）的延迟（微秒，默认0）
+*   NEWFS_DDRIVER_XFER_US   每读写一个IO单位的延迟（微秒，默认0）
+*   NEWFS_DDRIVER_URING     file后端的批量读写经io_uring提交（默认1），0则逐段preadv/pwritev
+*******************************************************************************/
+#define DDRIVER_MAX_DEV		8
+#define DDRIVER_DISK_SZ		(4 * 1024 * 1024)
+#define DDRIVER_IO_SZ		512
+#define DDRIVER_URING_SZ	64			// io_uring提交队列长度，批量请求超过时分轮提交
+#define DDRIVER_SEG_MAX		256			// 一段连续传输最多的IO单位数，不超过IOV_MAX
+
+// io_uring的提交/完成队列，直接以系统调用建立，不依赖liburing
+struct uring {
+	int fd;							// -1表示不可用
+	unsigned entries;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_ptr;
+	void* cq_ptr;
+	size_t sq_sz;
+	size_t cq_sz;
+};
+
+// 一段偏移连续的IO单位，对应一次readv/writev
+struct seg {
+	off_t offset;
+	struct iovec* iov;
+	int iovcnt;
+};
+
+struct dev {
+	int used;
+	int fd;							// 镜像文件
+	int use_mmap;
+	uint8_t* map;					// mmap后端的映射
+	off_t disk_sz;
+	int io_sz;
+	off_t pos;						// 磁头位置
+	long seek_ns;
+	long xfer_ns;
+	struct uring ring;
+	struct ddriver_state state;
+};
+
+static struct dev devs[DDRIVER_MAX_DEV];
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+// 读环境变量中的大小，支持K/M/G后缀
+static long env_size(const char* name, long def)
+{
+	const char* s = getenv(name);
+	char* end;
+	long v;
+
+	if (s == NULL || *s == '\0')
+		return def;
+	v = strtol(s, &end, 0);
+	switch (*end)
+	{
+	case 'G': case 'g': v <<= 10; /* fall through */
+	case 'M': case 'm': v <<= 10; /* fall through */
+	case 'K': case 'k': v <<= 10; break;
+	default: break;
+	}
+	return v;
+}
+
+static struct dev* dev_of(int fd)
+{
+	for (int i = 0; i < DDRIVER_MAX_DEV; ++i)
+		if (devs[i].used && devs[i].fd == fd)
+			return devs + i;
+	return NULL;
+}
+
+// 延迟模型：按设定时长睡眠，模拟机械磁盘的寻道与传输开销
+static void delay(long ns)
+{
+	struct timespec ts = { ns / 1000000000L, ns % 1000000000L };
+
+	if (ns <= 0)
+		return;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static int map_dev(struct dev* d)
+{
+	d->map = (uint8_t*)mmap(NULL, d->disk_sz, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
+	if (d->map == MAP_FAILED)
+	{
+		d->map = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************
+* SECTION: io_uring
+*******************************************************************************/
+static void uring_exit(struct uring* r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_sz);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_sz);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(struct uring));
+	r->fd = -1;
+}
+
+// 建立队列；内核不支持或被禁止时返回-1，调用者改用preadv/pwritev
+static int uring_init(struct uring* r, unsigned entries)
+{
+	struct io_uring_params p;
+	void* ptr;
+
+	memset(r, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+	r->entries = p.sq_entries;
+	r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (r->cq_sz > r->sq_sz)
+			r->sq_sz = r->cq_sz;
+		r->cq_sz = r->sq_sz;
+	}
+
+	ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto err;
+	r->sq_ptr = ptr;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ptr = r->sq_ptr;
+	else
+	{
+		ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto err;
+		r->cq_ptr = ptr;
+	}
+	ptr = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto err;
+	r->sqes = (struct io_uring_sqe*)ptr;
+
+	r->sq_tail = (unsigned*)((uint8_t*)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned*)((uint8_t*)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)((uint8_t*)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned*)((uint8_t*)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned*)((uint8_t*)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned*)((uint8_t*)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)((uint8_t*)r->cq_ptr + p.cq_off.cqes);
+	return 0;
+
+err:
+	uring_exit(r);
+	return -1;
+}
+
+// 同步完成一段，io_uring不可用或某段未能完整传输时使用
+static int seg_sync(struct dev* d, struct seg* sg, int write)
+{
+	ssize_t len = (ssize_t)sg->iovcnt * d->io_sz;
+	ssize_t ret = write ? pwritev(d->fd, sg->iov, sg->iovcnt, sg->offset)
+						: preadv(d->fd, sg->iov, sg->iovcnt, sg->offset);
+	return ret == len ? 0 : -1;
+}
+
+/**
+ * @brief 各段作为readv/writev一次放入提交队列，一次io_uring_enter提交并等待全部完成；
+ * 段数超过队列长度时分轮进行
+ *
+ * @return int 0成功；io_uring_enter出错时返回-1，已放入队列的段可能已完成也可能未执行
+ */
+static int uring_rw(struct dev* d, struct seg* segs, int cnt, int write)
+{
+	struct uring* r = &d->ring;
+	int ret = 0;
+
+	for (int done = 0; done < cnt; )
+	{
+		int n = cnt - done < (int)r->entries ? cnt - done : (int)r->entries;
+		unsigned tail = *r->sq_tail;
+		int submitted = 0, reaped = 0;
+
+		for (int i = 0; i < n; ++i, ++tail)
+		{
+			unsigned idx = tail & *r->sq_mask;
+			struct io_uring_sqe* sqe = r->sqes + idx;
+			struct seg* sg = segs + done + i;
+
+			memset(sqe, 0, sizeof(struct io_uring_sqe));
+			sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = d->fd;
+			sqe->off = sg->offset;
+			sqe->addr = (uintptr_t)sg->iov;
+			sqe->len = sg->iovcnt;
+			sqe->user_data = done + i;
+			r->sq_array[idx] = idx;
+		}
+		__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+		while (reaped < n)
+		{
+			int got = syscall(__NR_io_uring_enter, r->fd, n - submitted, n - reaped,
+							  IORING_ENTER_GETEVENTS, NULL, 0);
+			if (got < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			submitted += got;
+
+			unsigned head = *r->cq_head;
+			unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != ctail; ++head, ++reaped)
+			{
+				struct io_uring_cqe* cqe = r->cqes + (head & *r->cq_mask);
+				struct seg* sg = segs + cqe->user_data;
+				// 普通文件在文件大小之内不会传输不全，万一发生则同步补做
+				if (cqe->res != sg->iovcnt * d->io_sz && seg_sync(d, sg, write) < 0)
+					ret = -1;
+			}
+			__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		}
+		done += n;
+	}
+	return ret;
+}
+
+// 检查一次传输：恰好一个IO单位且不越过设备末尾
+static int xfer_check(struct dev* d, size_t size)
+{
+	if (d == NULL || (int)size != d->io_sz || d->pos < 0 || d->pos + (off_t)size > d->disk_sz)
+		return -1;
+	return 0;
+}
+
+/******************************************************************************
+* SECTION: ddriver接口
+*******************************************************************************/
+int ddriver_open(char *path)
+{
+	const char* backend = getenv("NEWFS_DDRIVER_BACKEND");
+	struct dev* d = NULL;
+	struct stat st;
+	int created = 0, err;
+
+	for (int i = 0; i < DDRIVER_MAX_DEV && d == NULL; ++i)
+		if (!devs[i].used)
+			d = devs + i;
+	if (d == NULL)
+		return -1;
+
+	memset(d, 0, sizeof(struct dev));
+	// 记下镜像是否由本次新建，失败时删除，不留下空文件
+	d->fd = open(path, O_RDWR);
+	if (d->fd < 0 && errno == ENOENT)
+	{
+		d->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+		created = d->fd >= 0;
+	}
+	if (d->fd < 0 || fstat(d->fd, &st) < 0)
+		goto err;
+	d->io_sz = (int)env_size("NEWFS_DDRIVER_IO_SZ", DDRIVER_IO_SZ);
+	if (d->io_sz <= 0)
+	{
+		errno = EINVAL;
+		goto err;
+	}
+	// 新建的镜像扩展为稀疏文件；已有镜像按IO单位向下取整
+	if (st.st_size == 0)
+	{
+		long sz = env_size("NEWFS_DDRIVER_SIZE", DDRIVER_DISK_SZ);
+		if (sz <= 0)
+		{
+			errno = EINVAL;
+			goto err;
+		}
+		if (ftruncate(d->fd, sz) < 0)
+			goto err;
+		st.st_size = sz;
+	}
+	d->disk_sz = st.st_size / d->io_sz * d->io_sz;
+	if (d->disk_sz == 0)
+	{
+		errno = EINVAL;
+		goto err;
+	}
+	d->seek_ns = env_size("NEWFS_DDRIVER_SEEK_US", 0) * 1000;
+	d->xfer_ns = env_size("NEWFS_DDRIVER_XFER_US", 0) * 1000;
+
+	d->use_mmap = backend && !strcasecmp(backend, "mmap");
+	if (d->use_mmap && map_dev(d) < 0)
+		goto err;
+	d->ring.fd = -1;
+	if (!d->use_mmap && env_size("NEWFS_DDRIVER_URING", 1))
+		uring_init(&d->ring, DDRIVER_URING_SZ);
+	d->used = 1;
+	return d->fd;
+
+err:
+	err = errno;
+	if (d->fd >= 0)
+		close(d->fd);
+	if (created)
+		unlink(path);
+	errno = err;
+	return -1;
+}
+
+int ddriver_seek(int fd, off_t offset, int whence)
+{
+	struct dev* d = dev_of(fd);
+	off_t pos;
+
+	if (d == NULL)
+		return -1;
+	switch (whence)
+	{
+	case SEEK_SET: pos = offset; break;
+	case SEEK_CUR: pos = d->pos + offset; break;
+	case SEEK_END: pos = d->disk_sz + offset; break;
+	default: return -1;
+	}
+	if (pos < 0 || pos > d->disk_sz || pos % d->io_sz)
+		return -1;
+	++d->state.seek_cnt;
+	// 顺序访问时磁头已在目标位置，不计寻道延迟
+	if (pos != d->pos)
+		delay(d->seek_ns);
+	d->pos = pos;
+	return 0;
+}
+
+int ddriver_write(int fd, char *buf, size_t size)
+{
+	struct dev* d = dev_of(fd);
+
+	if (xfer_check(d, size) < 0)
+		return -1;
+	if (d->use_mmap)
+		memcpy(d->map + d->pos, buf, size);
+	else if (pwrite(d->fd, buf, size, d->pos) != (ssize_t)size)
+		return -1;
+	delay(d->xfer_ns);
+	d->pos += size;
+	++d->state.write_cnt;
+	return 0;
+}
+
+int ddriver_read(int fd, char *buf, size_t size)
+{
+	struct dev* d = dev_of(fd);
+
+	if (xfer_check(d, size) < 0)
+		return -1;
+	if (d->use_mmap)
+		memcpy(buf, d->map + d->pos, size);
+	else if (pread(d->fd, buf, size, d->pos) != (ssize_t)size)
+		return -1;
+	delay(d->xfer_ns);
+	d->pos += size;
+	++d->state.read_cnt;
+	return 0;
+}
+
+int ddriver_submit(int fd, struct ddriver_req *reqs, int cnt, int write)
+{
+	struct dev* d = dev_of(fd);
+	struct iovec* iov;
+	struct seg* segs;
+	int nseg = 0;
+	int ret = 0;
+
+	if (d == NULL || cnt < 0)
+		return -1;
+	if (cnt == 0)
+		return 0;
+	for (int i = 0; i < cnt; ++i)
+		if (reqs[i].offset < 0 || reqs[i].offset % d->io_sz || reqs[i].offset + d->io_sz > d->disk_sz)
+			return -1;
+
+	iov = (struct iovec*)malloc(cnt * sizeof(struct iovec));
+	segs = (struct seg*)malloc(cnt * sizeof(struct seg));
+	// 偏移与上一段末尾相接的并入该段；计数与延迟同逐个seek+读写，磁头已在段首时不计寻道
+	for (int i = 0; i < cnt; ++i)
+	{
+		off_t off = reqs[i].offset;
+		struct seg* last = nseg ? segs + nseg - 1 : NULL;
+
+		if (last == NULL || off != last->offset + (off_t)last->iovcnt * d->io_sz || last->iovcnt == DDRIVER_SEG_MAX)
+		{
+			if (off != d->pos)
+			{
+				++d->state.seek_cnt;
+				delay(d->seek_ns);
+			}
+			last = segs + nseg++;
+			last->offset = off;
+			last->iov = iov + i;
+			last->iovcnt = 0;
+		}
+		iov[i].iov_base = reqs[i].buf;
+		iov[i].iov_len = d->io_sz;
+		++last->iovcnt;
+		delay(d->xfer_ns);
+		d->pos = off + d->io_sz;
+	}
+
+	if (d->use_mmap)
+	{
+		for (int i = 0; i < cnt; ++i)
+		{
+			if (write)
+				memcpy(d->map + reqs[i].offset, reqs[i].buf, d->io_sz);
+			else
+				memcpy(reqs[i].buf, d->map + reqs[i].offset, d->io_sz);
+		}
+	}
+	else if (d->ring.fd < 0 || uring_rw(d, segs, nseg, write) < 0)
+	{
+		// io_uring出错后不再使用；重做全部段，重复读写同样的数据不影响结果
+		if (d->ring.fd >= 0)
+			uring_exit(&d->ring);
+		for (int i = 0; i < nseg; ++i)
+			if (seg_sync(d, segs + i, write) < 0)
+				ret = -1;
+	}
+	if (write)
+		d->state.write_cnt += cnt;
+	else
+		d->state.read_cnt += cnt;
+
+	free(segs);
+	free(iov);
+	return ret;
+}
+
+int ddriver_ioctl(int fd, unsigned long cmd, void *ret)
+{
+	struct dev* d = dev_of(fd);
+
+	if (d == NULL)
+		return -1;
+	switch (cmd)
+	{
+	case IOC_REQ_DEVICE_SIZE:
+		// 不截断：按int读出的大小若被截断，会只用设备的一部分
+		if (d->disk_sz > INT_MAX)
+		{
+			errno = EFBIG;
+			return -1;
+		}
+		*(int*)ret = (int)d->disk_sz;
+		return 0;
+	case IOC_REQ_DEVICE_SIZE64:
+		*(int64_t*)ret = d->disk_sz;
+		return 0;
+	case IOC_REQ_DEVICE_IO_SZ:
+		*(int*)ret = d->io_sz;
+		return 0;
+	case IOC_REQ_DEVICE_STATE:
+		memcpy(ret, &d->state, sizeof(struct ddriver_state));
+		return 0;
+	case IOC_REQ_DEVICE_RESET:
+		// 截断再扩展，镜像清零且保持稀疏；映射的页面随之变为零页
+		if (ftruncate(d->fd, 0) < 0 || ftruncate(d->fd, d->disk_sz) < 0)
+			return -1;
+		memset(&d->state, 0, sizeof(struct ddriver_state));
+		d->pos = 0;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+int ddriver_close(int fd)
+{
+	struct dev* d = dev_of(fd);
+
+	if (d == NULL)
+		return -1;
+	if (d->map)
+	{
+		msync(d->map, d->disk_sz, MS_SYNC);
+		munmap(d->map, d->disk_sz);
+	}
+	if (d->ring.fd >= 0)
+		uring_exit(&d->ring);
+	close(d->fd);
+	d->used = 0;
+	d->map = NULL;
+	return 0;
+}
@@ -52,6 +52,27 @@ int ddriver_read(int fd, char *buf, size_t size);
  */
 int ddriver_ioctl(int fd, unsigned long cmd, void *ret);
 
+/**
+ * @brief 批量读写请求，一项为一个设备IO单位
+ */
+struct ddriver_req {
+    off_t offset;                       /* 设备偏移，与设备IO单位对齐 */
+    char *buf;                          /* 一个IO单位大小的缓冲区 */
+};
+
+/**
+ * @brief 批量读写（扩展接口）：一次提交多个IO单位，偏移相邻的单位合并传输，各段并发执行，
+ * 全部完成后返回。计数与逐个seek+读写相同，磁头停在最后一项之后。
+ * 只有ddriver/ddriver.c提供，课程ddriver库没有此函数，调用前须检查函数地址非空
+ * 
+ * @param fd ddriver设备handler
+ * @param reqs 请求列表，按偏移升序排列、互不重叠
+ * @param cnt 请求数
+ * @param write 非0写入，0读出
+ * @return int 0成功，否则失败
+ */
+int ddriver_submit(int fd, struct ddriver_req *reqs, int cnt, int write) __attribute__((weak));
+
 /**
  * @brief 关闭ddriver设备
  * 
@@ -2,6 +2,7 @@
 #define _DDRIVER_CTL_H_
 
 #include <sys/ioctl.h>   
+#include <stdint.h>
 /******************************************************************************
 * SECTION: IO ctl protocol definitions
 *******************************************************************************/
@@ -13,9 +14,10 @@ struct ddriver_state
     int seek_cnt;
 };
 
-#define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)                     /* 请求查看设备大小 */
+#define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)                     /* 请求查看设备大小，超出int时失败（EFBIG） */
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)    /* 请求设备状态，返回 ddriver_state */
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)                           /* 请求重置设备 */
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)                     /* 请求设备IO大小 */
+#define IOC_REQ_DEVICE_SIZE64   _IOR(IOC_MAGIC, 4, int64_t)                 /* 请求查看设备大小（64位） */
 
 #endif
\ No newline at end of file
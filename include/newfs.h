@@ -9,12 +9,23 @@
 #include "string.h"
 #include "fuse.h"
 #include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include "ddriver.h"
 #include "errno.h"
 #include "types.h"
 
 #define NEWFS_MAGIC 190110918
 #define NEWFS_DEFAULT_PERM    0777   /* 全权限打开 */
+#define JSUPER_MAGIC 0x4e464a53
+#define JDESC_MAGIC  0x4e464a44
+#define JWRAP_MAGIC  0x4e464a57
+#define JCOMMIT_MAGIC 0x4e464a43
+#define NEWFS_FEAT_DIRENT 0x1   /* 目录块为变长的newfs_dirent */
+#define NEWFS_FEAT_DINODE 0x2   /* inode表为定长的newfs_dinode */
+#define NEWFS_FEAT_OFF64  0x4   /* 超级块中的磁盘偏移为64位 */
+#define NEWFS_FEAT_REQUIRED (NEWFS_FEAT_DIRENT | NEWFS_FEAT_DINODE | NEWFS_FEAT_OFF64)
 
 /******************************************************************************
 * SECTION: newfs.c
@@ -38,6 +49,189 @@ int   			   newfs_utimens(const char *, const struct timespec tv[2]);
 int   			   newfs_truncate(const char *, off_t);
 			
 int   			   newfs_open(const char *, struct fuse_file_info *);
+int   			   newfs_release(const char *, struct fuse_file_info *);
 int   			   newfs_opendir(const char *, struct fuse_file_info *);
+int   			   newfs_releasedir(const char *, struct fuse_file_info *);
+int   			   newfs_fsync(const char *, int, struct fuse_file_info *);
+int   			   newfs_statfs(const char *, struct statvfs *);
+
+/******************************************************************************
+* SECTION: newfs_bitmap.c
+*******************************************************************************/
+void  			   newfs_bitmap_init(struct newfs_bitmap *, uint8_t *, int, int);
+void  			   newfs_bitmap_destroy(struct newfs_bitmap *);
+int   			   newfs_bitmap_alloc(struct newfs_bitmap *, int);
+int   			   newfs_bitmap_alloc_run(struct newfs_bitmap *, int, int, int *);
+void  			   newfs_bitmap_free(struct newfs_bitmap *, int);
+int   			   newfs_bitmap_test(struct newfs_bitmap *, int);
+int   			   newfs_bitmap_free_cnt(struct newfs_bitmap *);
+int   			   newfs_bitmap_seg_free(struct newfs_bitmap *, int);
+int   			   newfs_bitmap_dirty_cnt(struct newfs_bitmap *);
+int   			   newfs_bitmap_flush(struct newfs_bitmap *, off_t (*)(int), void (*)(off_t, int, uint8_t *));
+
+/******************************************************************************
+* SECTION: newfs_cache.c
+*******************************************************************************/
+int   			   newfs_cache_init(int);
+void  			   newfs_cache_destroy(void);
+void  			   newfs_cache_read(int, int, int, uint8_t *);
+void  			   newfs_cache_write(int, int, int, const uint8_t *);
+int   			   newfs_cache_write_pin(int, int, int, const uint8_t *);
+void  			   newfs_cache_unpin(int);
+void  			   newfs_cache_read_direct(struct newfs_iovec *, int);
+void  			   newfs_cache_write_direct(struct newfs_iovec *, int);
+void  			   newfs_cache_prefetch(int, int);
+void  			   newfs_cache_fetch(const int *, int);
+void  			   newfs_cache_readahead(int, int);
+int   			   newfs_cache_sync(void);
+void  			   newfs_driver_read(off_t, int, uint8_t *);
+void  			   newfs_driver_write(off_t, int, uint8_t *);
+
+/******************************************************************************
+* SECTION: newfs_dcache.c
+*******************************************************************************/
+struct newfs_dentry* newfs_dcache_lookup(const char *, int *);
+unsigned long	   newfs_dcache_gen(void);
+void  			   newfs_dcache_insert(const char *, struct newfs_dentry *, int, unsigned long);
+void  			   newfs_dcache_invalidate(const char *);
+void  			   newfs_dcache_clear(void);
+
+/******************************************************************************
+* SECTION: newfs_delalloc.c
+*******************************************************************************/
+int   			   newfs_da_write(struct newfs_inode *, int, int, int, const uint8_t *);
+int   			   newfs_da_read(struct newfs_inode *, int, int, int, uint8_t *);
+void  			   newfs_da_dirty(struct newfs_inode *);
+int   			   newfs_da_flush(struct newfs_inode *);
+void  			   newfs_da_flush_all(void);
+void  			   newfs_da_truncate(struct newfs_inode *, int, int);
+void  			   newfs_da_balance(void);
+int   			   newfs_da_reserved(void);
+int   			   newfs_da_claim(int);
+void  			   newfs_da_unclaim(int);
+int   			   newfs_da_start(void);
+void  			   newfs_da_stop(void);
+
+/******************************************************************************
+* SECTION: newfs_dir.c
+*******************************************************************************/
+void  			   newfs_dir_index_build(struct newfs_inode *);
+void  			   newfs_dir_index_add(struct newfs_inode *, int);
+struct newfs_dentry* newfs_dir_lookup(struct newfs_inode *, const char *);
+void  			   newfs_dir_index_free(struct newfs_inode *);
+int   			   newfs_dirent_len(const char *);
+void  			   newfs_dirent_encode(const struct newfs_dentry *, uint8_t *);
+int   			   newfs_dirent_decode(const uint8_t *, int, struct newfs_dentry *, int);
+
+/******************************************************************************
+* SECTION: newfs_extent.c
+*******************************************************************************/
+void  			   newfs_extent_load(struct newfs_inode *);
+void  			   newfs_extent_sync(struct newfs_inode *);
+void  			   newfs_extent_free(struct newfs_inode *);
+int   			   newfs_bmap(struct newfs_inode *, int, int *);
+int   			   newfs_extent_alloc(struct newfs_inode *, int, int);
+int   			   newfs_extent_room(struct newfs_inode *, int);
+void  			   newfs_extent_truncate(struct newfs_inode *, int);
+
+/******************************************************************************
+* SECTION: newfs_file.c
+*******************************************************************************/
+void  			   newfs_inode_serialize(const struct newfs_inode *, struct newfs_dinode *);
+void  			   newfs_inode_deserialize(struct newfs_inode *, const struct newfs_dinode *);
+void  			   newfs_inode_sync(struct newfs_inode *);
+int   			   newfs_file_read(struct newfs_inode *, char *, size_t, off_t);
+int   			   newfs_file_write(struct newfs_inode *, const char *, size_t, off_t);
+int   			   newfs_file_truncate(struct newfs_inode *, off_t);
+
+/******************************************************************************
+* SECTION: newfs_format.c
+*******************************************************************************/
+off_t 			   newfs_dev_size(int);
+int   			   newfs_geometry(struct newfs_super *, off_t, int, int);
+int   			   newfs_format(int, off_t, int, int, struct newfs_super *);
+void  			   newfs_super_serialize(const struct newfs_super *, struct newfs_dsuper *);
+void  			   newfs_super_deserialize(struct newfs_super *, const struct newfs_dsuper *);
+off_t 			   newfs_ino_off(const struct newfs_super *, int);
+off_t 			   newfs_blk_off(const struct newfs_super *, int);
+int   			   newfs_blk_contig(const struct newfs_super *, int);
+off_t 			   newfs_imap_off(const struct newfs_super *, int);
+off_t 			   newfs_dmap_off(const struct newfs_super *, int);
+
+/******************************************************************************
+* SECTION: newfs_group.c
+*******************************************************************************/
+void  			   newfs_group_load(void);
+off_t 			   newfs_group_imap_off(int);
+off_t 			   newfs_group_dmap_off(int);
+int   			   newfs_group_of_ino(int);
+int   			   newfs_group_ialloc(struct newfs_inode *, FILE_TYPE);
+int   			   newfs_group_goal(struct newfs_inode *);
+
+/******************************************************************************
+* SECTION: newfs_journal.c
+*******************************************************************************/
+int   			   newfs_journal_load(void);
+int   			   newfs_journal_start(void);
+void  			   newfs_journal_stop(void);
+void  			   newfs_journal_begin(int);
+void  			   newfs_journal_end(void);
+void  			   newfs_journal_write(off_t, int, uint8_t *);
+void  			   newfs_journal_revoke(int);
+void  			   newfs_journal_free(int);
+int   			   newfs_journal_freeing(void);
+void  			   newfs_journal_commit(void);
+
+/******************************************************************************
+* SECTION: newfs_lock.c
+*******************************************************************************/
+void  			   newfs_tree_lock(int);
+void  			   newfs_tree_unlock(void);
+void  			   newfs_retire(void *);
+int   			   newfs_retire_pending(void);
+void  			   newfs_reclaim(void);
+
+/******************************************************************************
+* SECTION: newfs_stats.c
+*******************************************************************************/
+void  			   newfs_stats_reset(void);
+long  			   newfs_stats_begin(int);
+void  			   newfs_stats_end(int, long);
+void  			   newfs_stats_io(int, int, int);
+void  			   newfs_stats_cache(int);
+void  			   newfs_stats_dcache(int);
+int   			   newfs_stats_render(char **);
+void  			   newfs_stats_dump(FILE *);
+
+/******************************************************************************
+* SECTION: newfs_super.c
+*******************************************************************************/
+int   			   newfs_super_open(const char *, const char *, int);
+void  			   newfs_super_close(void);
+
+/******************************************************************************
+* SECTION: newfs_slab.c
+*******************************************************************************/
+void  			   newfs_pool_init(struct newfs_pool *, const char *, size_t, int);
+void* 			   newfs_pool_alloc(struct newfs_pool *);
+void  			   newfs_pool_free(struct newfs_pool *, void *);
+void  			   newfs_pool_stat(struct newfs_pool *, FILE *);
+void  			   newfs_pool_destroy(struct newfs_pool *);
+
+/******************************************************************************
+* SECTION: newfs_readahead.c
+*******************************************************************************/
+int   			   newfs_readahead_start(void);
+void  			   newfs_readahead_stop(void);
+struct newfs_ra*   newfs_ra_new(void);
+void  			   newfs_readahead(struct newfs_inode *, struct newfs_ra *, off_t, size_t);
+
+/******************************************************************************
+* SECTION: newfs_io.c
+*******************************************************************************/
+int   			   newfs_io_submit(struct newfs_iovec *, int, int);
+void  			   newfs_io_reset(void);
+void  			   newfs_io_stat_begin(void);
+void  			   newfs_io_stat_end(const char *);
 
 #endif  /* _newfs_H_ */
\ No newline at end of file
@@ -2,17 +2,55 @@
 #define _TYPES_H_
 
 #define MAX_NAME_LEN 128    
-#define MAX_DIRECT_ACC 6
-#define MAX_FILE_NUM 512
-#define INODE_MAP_SZ 64     // MAX_FILE_NUM / 8
-#define DATA_MAP_SZ 384     // MAX_FILE_NUM * MAX_DIRECT_ACC / 8
+#define INODE_EXTENT_NUM 4  // inode内直接存放的extent数
+#define NEWFS_LINK_MAX 65535 // 链接数上限（磁盘上为uint16），目录的子目录数随之受限
+#define NEWFS_BYTES_PER_INODE 8192  // 格式化时每多少字节设备空间配一个inode（默认值）
+
+#define CACHE_BLK_NUM 2048  // 块缓存容纳的设备块数
+#define CACHE_HASH_SZ 4096  // 块缓存哈希桶数，取2的幂
+#define DCACHE_SZ 1024      // 路径缓存槽数，取2的幂
+#define CACHE_INODE_NUM 4096 // 内存中最多装入的inode数（默认值）
+#define ENTRY_TIMEOUT 60.0  // 内核目录项缓存有效期（秒，默认值）
+#define ATTR_TIMEOUT 60.0   // 内核属性缓存有效期（秒，默认值）
+#define RA_MIN_BLKS 16      // 预读窗口初始大小（数据块数）
+#define RA_MAX_BLKS 256     // 预读窗口上限（数据块数），不超过块缓存的四分之一
+#define RA_QUEUE_SZ 64      // 预读请求队列长度
+#define FETCH_BLKS 64       // 目录块、子项inode批量读入时每批的设备块数
+#define DA_MAX_PAGES 1024   // 延迟分配缓冲的数据块总数上限，超出时全部落盘
+#define DA_EXPIRE_SEC 5     // 延迟分配缓冲最长驻留秒数
+#define STATS_HIST_NUM 32   // 操作时延直方图的桶数，第i桶为[2^i, 2^(i+1))纳秒
+#define NEWFS_STATS_PATH "/.newfs_stats" // 只读的统计虚拟文件
+#define RETIRE_MAX 4096     // 待回收的路径缓存项超过此数时做一次独占回收
+#define INODE_PER_SLAB 64   // inode对象池每次向malloc申请的对象数
+#define DENTRY_PER_SLAB 256 // 目录项对象池每次向malloc申请的对象数
+#define JOURNAL_BLKS 1024   // 日志区最少设备块数（含日志超级块），按设备的1/128增大；超过设备1/4时不启用日志
+#define JOURNAL_MAX_BLKS 65536 // 日志区最多设备块数
+#define JOURNAL_TX_MAX 128  // 一个事务最多记录的设备块数，含撤销记录与位图段
+#define JOURNAL_INODE_CREDITS (1 + 2 * INODE_EXTENT_NUM) // 写回一个inode的记录块数：inode所在设备块，及各extent块的2个设备块（写入或撤销）
+#define JOURNAL_CREDITS (2 * JOURNAL_INODE_CREDITS + 5 + INODE_EXTENT_NUM) // 建目录项的记录块数：两个inode、目录项（至多3个设备块）、inode位图段，及目录块与extent块的data位图段
+#define JOURNAL_FREE_SEGS 32 // 事务提交后归还释放的块时至多改动的data位图段数，其余留待下一事务
+#define DA_FLUSH_BLKS 32    // 延迟分配落盘时每个事务至多分配的数据块数
+#define JOURNAL_COMMIT_MS 5 // 提交线程的合并间隔（毫秒），期间的并发操作合为一个事务；无日志区时为位图段的写出间隔
+#define FSCK_THREADS_MAX 16 // fsck.newfs扫描线程数上限
+#define FSCK_READ_BLKS 256  // fsck.newfs读目录与extent块时每批的设备块数
+// 事务钉住的块须远少于缓存块数，缓存总有块可淘汰
+_Static_assert(JOURNAL_TX_MAX <= CACHE_BLK_NUM / 4, "journal pins must leave most of the block cache evictable");
 
 #define ROUND_DOWN(value, round) (value % round == 0 ? value : (value / round) * round)
 #define ROUND_UP(value, round) (value % round == 0 ? value : (value / round + 1) * round)
 #define CEIL(value, round) (value % round == 0 ? (value / round) : (value / round + 1))
 
+#define NEWFS_IO_READ  0
+#define NEWFS_IO_WRITE 1
+
 struct custom_options {
 	char*        device;
+	int          io_stat;   // --io-stat：每个操作结束后输出设备IO计数
+	int          cache_inodes;  // --cache-inodes=N：内存中最多装入的inode数
+	int          bytes_per_inode;   // --bytes-per-inode=N：挂载时自动格式化所用的每inode字节数
+	double       entry_timeout;     // --entry-timeout=SEC：内核目录项缓存有效期
+	double       attr_timeout;      // --attr-timeout=SEC：内核属性缓存有效期
+	char*        cache;             // --cache=kernel|auto|none：打开文件时保留/按mtime与大小判断/丢弃内核页缓存，未给出为NULL，按kernel处理
 };
 
 typedef enum file_type {
@@ -20,42 +58,160 @@ typedef enum file_type {
     DIR         // 目录文件
 } FILE_TYPE;
 
+struct newfs_bitmap {
+    uint8_t* map;           // 位图内存地址
+    int bits;               // 总位数
+    int free;               // 空闲位数
+    int hint;               // 下次分配开始查找的64位字下标
+    int seg_bytes;          // 段大小（字节），段与磁盘上的位图块（即块组）一一对应
+    int seg_cnt;
+    uint8_t* seg_dirty;     // 各段自上次写出后是否有改动
+    int dirty_cnt;          // 改动过的段数，即下次写出的段数
+    int* seg_free;          // 各段空闲位数，即各块组的空闲数
+    pthread_mutex_t lock;   // 保护以上各项；free可不加锁原子读取
+    pthread_mutex_t flush_lock; // 串行化写出，拷贝与写盘之间不被另一次写出插入
+};
+
+// 内存中的超级块：设备信息、布局参数及位图等运行时状态，磁盘格式见newfs_dsuper
 struct newfs_super {
     // 驱动信息
     int fd;
     int dev_io_sz;
-    int dev_disk_sz;
+    off_t dev_disk_sz;
 
     // 文件系统信息
     uint32_t magic;         // 文件系统标识
-    int max_ino;            // 最多支持的文件数
+    int max_ino;            // 最多支持的文件数，即inode位图位数
     // inode位图信息
     uint8_t* map_inode;     // inode位图内存地址
     int map_inode_blks;     // inode位图占用的磁盘块数
-    int map_inode_offset;   // inode位图在磁盘上的偏移
+    off_t map_inode_offset; // inode位图在磁盘上的偏移
     // data位图信息
     uint8_t* map_data;      // data位图内存地址
     int map_data_blks;      // data位图占用的磁盘块数
-    int map_data_offset;    // data位图在磁盘上的偏移
+    off_t map_data_offset;  // data位图在磁盘上的偏移
+    // 位图分配器
+    struct newfs_bitmap inode_bm;
+    struct newfs_bitmap data_bm;
 
-    int inode_offset;       // inode起始磁盘偏移
-    int data_offset;        // data起始磁盘偏移
+    off_t inode_offset;     // inode起始磁盘偏移
+    off_t data_offset;      // data起始磁盘偏移
 
     // 根目录
     struct newfs_dentry* root_dentry;   // 根目录内存地址
+
+    // 日志区，位于超级块与块组之间；设备太小时为0，即不启用日志
+    off_t journal_offset;   // 日志区起始磁盘偏移
+    int journal_blks;       // 日志区设备块数
+
+    // 由设备大小推出的布局参数
+    int max_data;           // 数据块数，即data位图位数
+    int bytes_per_inode;    // 格式化时的每inode字节数
+
+    // 块组：超级块 | 日志 | 块组0 | 块组1 | ...，每组为 inode位图 | data位图 | inode表 | data区，
+    // 各占一个设备块的位图分别覆盖本组的inode与数据块。
+    // 上面的map_*_offset、inode_offset、data_offset记录0号组的位置，仅供显示
+    int group_cnt;          // 块组数
+    int inodes_per_group;   // 每组inode数
+    int blocks_per_group;   // 每组数据块数，最后一组可能较少
+    int group_blks;         // 每组占用的设备块数
+    off_t group_offset;     // 0号组起始磁盘偏移
+    int itable_blks;        // 每组inode表的设备块数
+
+    int features;           // NEWFS_FEAT_*，挂载时须包含NEWFS_FEAT_REQUIRED
+};
+
+struct newfs_extent {
+    int lblk;               // 起始逻辑块号
+    int pblk;               // 起始data区块号
+    int len;                // 连续块数
+};
+
+// 磁盘上的超级块，定长NEWFS_DSUPER_SZ字节，位于0号设备块。只含格式化时确定的布局参数，
+// 与内存中的newfs_super经serialize/deserialize转换；位图、根目录等内存状态不落盘
+struct newfs_dsuper {
+    uint32_t magic;             // NEWFS_MAGIC
+    int32_t features;           // NEWFS_FEAT_*
+    int32_t io_sz;              // 格式化时的设备IO单位
+    int32_t max_ino;
+    int32_t max_data;
+    int32_t bytes_per_inode;
+    int32_t journal_blks;
+    int32_t group_cnt;
+    int32_t inodes_per_group;
+    int32_t blocks_per_group;
+    int32_t group_blks;
+    int32_t itable_blks;
+    int64_t journal_offset;     // 字节偏移为64位（NEWFS_FEAT_OFF64），设备可超过2 GiB
+    int64_t group_offset;
+    uint8_t reserved[64];
+};
+
+#define NEWFS_DSUPER_SZ 128
+_Static_assert(sizeof(struct newfs_dsuper) == NEWFS_DSUPER_SZ, "newfs_dsuper must stay NEWFS_DSUPER_SZ bytes");
+
+// 磁盘上的inode，定长NEWFS_DINODE_SZ字节，每个设备块恰好放整数个且2的幂个，
+// 装入或写回一个inode只涉及一个设备块。与内存中的newfs_inode经serialize/deserialize转换
+struct newfs_dinode {
+    int32_t ino;
+    int32_t size;
+    uint16_t ftype;
+    uint16_t nlink;
+    int32_t dir_cnt;
+    int32_t extent_cnt;
+    int32_t extent_depth;
+    int64_t atime;          // 纳秒
+    int64_t mtime;
+    int64_t ctime;
+    struct newfs_extent extents[INODE_EXTENT_NUM];
+    uint8_t reserved[32];
 };
 
+#define NEWFS_DINODE_SZ 128
+_Static_assert(sizeof(struct newfs_dinode) == NEWFS_DINODE_SZ, "newfs_dinode must stay NEWFS_DINODE_SZ bytes");
+
 struct newfs_inode {
     int ino;                // 在inode位图中的下标
     int size;               // 文件已占用空间
 
     FILE_TYPE ftype;        // 文件类型（目录类型、普通文件类型）
+    int nlink;              // 链接数
     int dir_cnt;            // 如果是目录类型文件，下面有几个目录项
+    struct timespec atime;  // 访问、修改、状态改变时间
+    struct timespec mtime;
+    struct timespec ctime;
 
     struct newfs_dentry* dentry;        // 指向该inode的dentry内存地址
-    struct newfs_dentry* dentrys;       // 所有目录项内存起始地址
+    struct newfs_dentry** dentrys;      // 子目录项指针数组，满时容量加倍；目录项本身取自对象池、
+                                        // 不随数组移动，其地址在目录项存在期间始终有效
+    int dir_cap;                        // dentrys容量
+    int* dir_index;                     // 目录项哈希索引：文件名 -> dentrys下标
+    int dir_index_sz;                   // 哈希索引槽数，2的幂
+    unsigned long tick;                 // 最近访问计数，冷子树优先卸载
+    pthread_rwlock_t lock;              // 目录：保护目录项、索引及子目录项的装入；文件：保护内容、大小与映射
+
+    int extent_cnt;                     // extent总数
+    int extent_depth;                   // 0：extents[]即extent；1：extents[]为extent块索引
+    struct newfs_extent extents[INODE_EXTENT_NUM];
+
+    struct newfs_extent* ext_map;       // 内存中的全部extent，按lblk升序
+    int ext_cap;                        // ext_map容量
+    int ext_dirty;                      // ext_map有未写回的修改
+    int ext_leaf[INODE_EXTENT_NUM];     // extent块号，0为未分配
+
+    struct newfs_dpage* dpages;         // 延迟分配的数据块缓冲，按lblk升序
+    int dpage_cnt;
+    int dpage_cap;
+    int da_leaf;                        // 为缓冲块落盘后的extent预留的extent块数
+    int da_dirty;                       // 在脏inode链表中，size、映射或时间待写回
+    struct newfs_inode* da_prev;        // 脏inode链表
+    struct newfs_inode* da_next;
+};
 
-    int block_pointer[MAX_DIRECT_ACC];  // 数据块号          
+// 尚未分配数据块的文件块，落盘时才分配
+struct newfs_dpage {
+    int lblk;                           // 逻辑块号
+    uint8_t* data;                      // 一个数据块大小的内容，未写部分为0
 };
 
 struct newfs_dentry {
@@ -65,4 +221,135 @@ struct newfs_dentry {
     struct newfs_inode* inode;      // 指向的inode内存地址
 };
 
+// 磁盘上的目录项：变长、4字节对齐、紧凑排列且不跨数据块；块尾放不下下一项时，
+// 以name_len为0的项头（或不足一个项头的空隙）结束该块。内存中仍用newfs_dentry
+struct newfs_dirent {
+    int ino;                        // 指向的ino号
+    uint8_t ftype;                  // 指向的ino文件类型
+    uint8_t name_len;               // 文件名长度，0表示本块其余部分为空
+    char name[];                    // 文件名，不以'\0'结尾
+};
+
+#define DIRENT_HDR_SZ       ((int)offsetof(struct newfs_dirent, name))
+#define DIRENT_LEN(name_len) ((DIRENT_HDR_SZ + (name_len) + 3) & ~3)
+
+struct newfs_iovec {
+    int blkno;                      // 设备块号
+    uint8_t* buf;                   // 一个设备块大小的缓冲区
+};
+
+struct newfs_buf {
+    int blkno;                      // 设备块号（以dev_io_sz为单位）
+    int valid;                      // 是否已装入有效数据
+    int dirty;                      // 是否被修改未写回
+    int pinned;                     // 属于未提交的日志事务，提交前不得写回原位
+    int busy;                       // 正在不持cache_lock装入或写回，完成前不得淘汰
+    uint8_t* data;                  // 块数据
+
+    struct newfs_buf* hash_next;    // 哈希链
+    struct newfs_buf* lru_prev;     // LRU链，表头最近使用
+    struct newfs_buf* lru_next;
+};
+
+// 正在不持cache_lock读写设备的块（直接读写，或缓存块的装入、写回）；完成前其他路径不得把该块装入缓存
+struct newfs_busy {
+    int blkno;                      // 设备块号
+    int rw;                         // NEWFS_IO_READ或NEWFS_IO_WRITE
+    struct newfs_busy* next;        // 哈希链
+};
+
+// 打开文件的预读状态，存放于fi->fh；inode可能被卸载，故只记偏移
+struct newfs_ra {
+    off_t next_off;                 // 顺序读时下一次读的起始偏移
+    int window;                     // 当前预读窗口（数据块数）
+    int ra_end;                     // 已发出预读的逻辑块上界（不含）
+    pthread_mutex_t lock;           // 同一打开文件上的并发读只有一个更新预读状态
+};
+
+// 统计的FUSE操作，见newfs_stats.c
+enum newfs_op {
+    NEWFS_OP_OTHER,                 // 不属于任何操作：后台线程、挂载
+    NEWFS_OP_GETATTR,
+    NEWFS_OP_MKDIR,
+    NEWFS_OP_MKNOD,
+    NEWFS_OP_READDIR,
+    NEWFS_OP_OPEN,
+    NEWFS_OP_RELEASE,
+    NEWFS_OP_READ,
+    NEWFS_OP_WRITE,
+    NEWFS_OP_TRUNCATE,
+    NEWFS_OP_UTIMENS,
+    NEWFS_OP_FSYNC,
+    NEWFS_OP_DESTROY,               // 卸载时的全部落盘
+    NEWFS_OP_NUM
+};
+
+// 一个操作的计数
+struct newfs_op_stat {
+    long calls;
+    long ns;                        // 时延总和
+    long max_ns;
+    long hist[STATS_HIST_NUM];      // 时延直方图，按2的幂分桶
+    long dev_read;                  // 设备读、写的IO单位数与seek次数
+    long dev_write;
+    long dev_seek;
+    long cache_hit;                 // 块缓存命中/未命中次数
+    long cache_miss;
+    long dcache_hit;                // 路径缓存命中/未命中次数
+    long dcache_miss;
+};
+
+// 定长对象池，见newfs_slab.c
+struct newfs_pool {
+    const char* name;
+    size_t obj_sz;                  // 对象大小，按最大对齐取整
+    int per_slab;                   // 每个slab的对象数
+    void* free_list;                // 空闲对象单链表，链接指针存于对象首部
+    void* slabs;                    // 已申请的slab链表
+    int slab_cnt;
+    int in_use;                     // 在用对象数
+    int peak;                       // 在用对象数峰值
+    long allocs;                    // 累计分配次数
+    long frees;                     // 累计释放次数
+    pthread_mutex_t lock;
+};
+
+// opendir句柄，存放于fi->fh；readdir首批时生成目录项及属性的快照，后续批次直接从快照填充
+struct newfs_dirh_ent {
+    char name[MAX_NAME_LEN];
+    struct stat st;
+};
+
+struct newfs_dirh {
+    int cnt;                        // 快照中的目录项数，-1表示尚未生成
+    struct newfs_dirh_ent* ents;
+};
+
+struct newfs_ra_req {
+    int blkno;                      // 起始设备块号
+    int cnt;                        // 设备块数
+};
+
+// 日志超级块，位于日志区第0块
+struct newfs_jsuper {
+    uint32_t magic;
+    uint32_t seq;                   // tail处事务的序号
+    int tail;                       // 最老的未检查点事务在日志区内的块号
+};
+
+// 事务描述块：其后依次是tags、各块映像（每个非负tag一块）和提交块
+// tag >= 0为记录的设备块号；tag < 0为撤销记录，-(blkno + 1)的旧映像不得重放
+struct newfs_jdesc {
+    uint32_t magic;                 // JDESC_MAGIC；JWRAP_MAGIC表示本事务从日志区开头写起
+    uint32_t seq;
+    int cnt;                        // tag数
+    int tags[];
+};
+
+struct newfs_jcommit {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t csum;                  // tags与映像的校验和，检出写了一半的事务
+};
+
 #endif /* _TYPES_H_ */
\ No newline at end of file
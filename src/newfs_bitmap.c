@@ -0,0 +1,325 @@
+#include "newfs.h"
+#include <endian.h>
+
+/******************************************************************************
+* SECTION: 位图分配器，按64位字扫描，next-fit提示，维护空闲计数
+*******************************************************************************/
+#define WORD_BITS	64
+
+// 取第w个64位字；位图末尾不足一字的部分视为已占用
+static uint64_t load_word(const struct newfs_bitmap* bm, int w)
+{
+	uint64_t v = ~(uint64_t)0;
+	int bytes = bm->bits / 8 - w * 8;
+	if (bytes > 8)
+		bytes = 8;
+	memcpy(&v, bm->map + w * 8, bytes);
+	return le64toh(v);
+}
+
+static int bit_test(const struct newfs_bitmap* bm, int bit)
+{
+	return (bm->map[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void seg_mark(struct newfs_bitmap* bm, int bit)
+{
+	int seg = bit / 8 / bm->seg_bytes;
+	if (!bm->seg_dirty[seg])
+	{
+		bm->seg_dirty[seg] = 1;
+		__atomic_add_fetch(&bm->dirty_cnt, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void bit_set(struct newfs_bitmap* bm, int bit)
+{
+	bm->map[bit / 8] |= (1 << (bit % 8));
+	seg_mark(bm, bit);
+	__atomic_sub_fetch(&bm->seg_free[bit / 8 / bm->seg_bytes], 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&bm->free, 1, __ATOMIC_RELAXED);
+}
+
+// 从第start位开始环形查找第一个有空位的字，字内用ctz定位；
+// 首字中start之前的位留到绕回一圈时再查
+static int bit_alloc(struct newfs_bitmap* bm, int start)
+{
+	int nwords = CEIL(bm->bits, WORD_BITS);
+	int w0 = start / WORD_BITS;
+
+	if (bm->free == 0)
+		return -ENOSPC;
+
+	for (int k = 0; k <= nwords; ++k)
+	{
+		int w = (w0 + k) % nwords;
+		uint64_t v = load_word(bm, w);
+		if (k == 0)
+			v |= ((uint64_t)1 << (start % WORD_BITS)) - 1;
+		if (v == ~(uint64_t)0)
+			continue;
+
+		int bit = w * WORD_BITS + __builtin_ctzll(~v);
+		bit_set(bm, bit);
+		bm->hint = w;
+		return bit;
+	}
+	return -ENOSPC;
+}
+
+// 从第start位开始环形查找不短于want位的空闲段，全空与全满的字整字跳过；段不跨越位图末尾。
+// 找不到时退而取途中最长的空闲段。返回段起始位，len返回段长（不超过want），全满返回-ENOSPC
+static int span_find(const struct newfs_bitmap* bm, int start, int want, int* len)
+{
+	int nwords = CEIL(bm->bits, WORD_BITS);
+	int w0 = start / WORD_BITS;
+	int run_start = 0, run_len = 0;
+	int best = -ENOSPC, best_len = 0;
+
+	if (bm->free == 0)
+		return -ENOSPC;
+
+	for (int k = 0; k <= nwords; ++k)
+	{
+		int w = (w0 + k) % nwords;
+		uint64_t v = load_word(bm, w);
+		if (k == 0)
+			v |= ((uint64_t)1 << (start % WORD_BITS)) - 1;
+		if (w == 0)
+			run_len = 0;
+		for (int b = 0; b < WORD_BITS; ++b)
+		{
+			if (v == ~(uint64_t)0)
+			{
+				run_len = 0;
+				break;
+			}
+			if (v == 0 && run_len + WORD_BITS < want)
+			{
+				// 整字空闲且仍不够长，一次并入
+				if (run_len == 0)
+					run_start = w * WORD_BITS;
+				run_len += WORD_BITS;
+				break;
+			}
+			if ((v >> b) & 1)
+			{
+				run_len = 0;
+				continue;
+			}
+			if (run_len++ == 0)
+				run_start = w * WORD_BITS + b;
+			if (run_len >= want)
+			{
+				*len = want;
+				return run_start;
+			}
+			if (run_len > best_len)
+			{
+				best = run_start;
+				best_len = run_len;
+			}
+		}
+		if (run_len > best_len)
+		{
+			best = run_start;
+			best_len = run_len;
+		}
+	}
+	*len = best_len;
+	return best;
+}
+
+// 查找起点：有效的goal，否则next-fit提示处
+static int alloc_start(const struct newfs_bitmap* bm, int goal)
+{
+	return goal >= 0 && goal < bm->bits ? goal : bm->hint * WORD_BITS;
+}
+
+/******************************************************************************
+* SECTION: 位图接口，各位图各自加锁
+*******************************************************************************/
+/**
+ * @brief 绑定位图内存并统计空闲位数，位图装入或清零后调用
+ *
+ * @param bm 位图
+ * @param map 位图内存，第i位位于map[i / 8]的第(i % 8)位，与磁盘格式一致
+ * @param bits 总位数，须为8的倍数
+ * @param seg_bytes 分段大小（字节），改动按段记录，只写出改动过的段
+ */
+void newfs_bitmap_init(struct newfs_bitmap* bm, uint8_t* map, int bits, int seg_bytes)
+{
+	int nwords = CEIL(bits, WORD_BITS);
+
+	bm->map = map;
+	bm->bits = bits;
+	bm->hint = 0;
+	bm->free = 0;
+	bm->seg_bytes = seg_bytes;
+	bm->seg_cnt = CEIL(bits / 8, seg_bytes);
+	bm->seg_dirty = (uint8_t*)calloc(bm->seg_cnt, 1);
+	bm->dirty_cnt = 0;
+	bm->seg_free = (int*)calloc(bm->seg_cnt, sizeof(int));
+	for (int i = 0; i < bits; ++i)
+		if (!bit_test(bm, i))
+			++bm->seg_free[i / 8 / seg_bytes];
+	// 位图结构随超级块从磁盘读入，锁须重新初始化
+	pthread_mutex_init(&bm->lock, NULL);
+	pthread_mutex_init(&bm->flush_lock, NULL);
+	for (int w = 0; w < nwords; ++w)
+		bm->free += WORD_BITS - __builtin_popcountll(load_word(bm, w));
+}
+
+/**
+ * @brief 分配一位
+ *
+ * @param goal 从goal开始向后环形查找，-1表示从next-fit提示处查找
+ * @return int 分配到的位号，满时返回-ENOSPC
+ */
+int newfs_bitmap_alloc(struct newfs_bitmap* bm, int goal)
+{
+	pthread_mutex_lock(&bm->lock);
+	int bit = bit_alloc(bm, alloc_start(bm, goal));
+	pthread_mutex_unlock(&bm->lock);
+	return bit;
+}
+
+/**
+ * @brief 尽量分配连续的一段：goal空闲时从goal开始向后延伸（紧接前一段，便于合并extent）；
+ * 否则从goal（为-1时从next-fit提示处）向后查找不短于want位的空闲段，没有时取最长的空闲段
+ *
+ * @param goal 期望的起始位，-1表示不指定
+ * @param want 期望的连续位数
+ * @param got 返回实际分配的连续位数
+ * @return int 起始位号，满时返回-ENOSPC
+ */
+int newfs_bitmap_alloc_run(struct newfs_bitmap* bm, int goal, int want, int* got)
+{
+	int start;
+
+	pthread_mutex_lock(&bm->lock);
+	if (goal >= 0 && goal < bm->bits && !bit_test(bm, goal))
+	{
+		start = goal;
+		bit_set(bm, start);
+		*got = 1;
+		while (*got < want && start + *got < bm->bits && !bit_test(bm, start + *got))
+		{
+			bit_set(bm, start + *got);
+			++*got;
+		}
+	}
+	else if ((start = span_find(bm, alloc_start(bm, goal), want, got)) >= 0)
+	{
+		for (int i = 0; i < *got; ++i)
+			bit_set(bm, start + i);
+		bm->hint = (start + *got - 1) / WORD_BITS;
+	}
+	pthread_mutex_unlock(&bm->lock);
+	return start;
+}
+
+/**
+ * @brief 释放一位
+ */
+void newfs_bitmap_free(struct newfs_bitmap* bm, int bit)
+{
+	pthread_mutex_lock(&bm->lock);
+	if (bit_test(bm, bit))
+	{
+		bm->map[bit / 8] &= ~(1 << (bit % 8));
+		seg_mark(bm, bit);
+		__atomic_add_fetch(&bm->seg_free[bit / 8 / bm->seg_bytes], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&bm->free, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&bm->lock);
+}
+
+/**
+ * @brief 查询某位是否已占用
+ */
+int newfs_bitmap_test(struct newfs_bitmap* bm, int bit)
+{
+	pthread_mutex_lock(&bm->lock);
+	int ret = bit_test(bm, bit);
+	pthread_mutex_unlock(&bm->lock);
+	return ret;
+}
+
+/**
+ * @brief 空闲位数，不加锁
+ */
+int newfs_bitmap_free_cnt(struct newfs_bitmap* bm)
+{
+	return __atomic_load_n(&bm->free, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 释放分段标记，卸载时调用，位图内存由调用者释放
+ */
+void newfs_bitmap_destroy(struct newfs_bitmap* bm)
+{
+	free(bm->seg_dirty);
+	bm->seg_dirty = NULL;
+	free(bm->seg_free);
+	bm->seg_free = NULL;
+	pthread_mutex_destroy(&bm->lock);
+	pthread_mutex_destroy(&bm->flush_lock);
+}
+
+/**
+ * @brief 段内空闲位数，不加锁，用于按块组挑选分配位置
+ */
+int newfs_bitmap_seg_free(struct newfs_bitmap* bm, int seg)
+{
+	return __atomic_load_n(&bm->seg_free[seg], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 改动过、下次写出的段数，不加锁，供日志估计事务大小
+ */
+int newfs_bitmap_dirty_cnt(struct newfs_bitmap* bm)
+{
+	return __atomic_load_n(&bm->dirty_cnt, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 写出改动过的段并清除其标记；各段在锁内拷贝，写出时不持锁。
+ * 整个写出持有flush_lock：否则并发的两次写出中，先拷贝的旧内容可能后落盘
+ *
+ * @param seg_off 段号 -> 该段在磁盘上的偏移（各块组的位图不连续）
+ * @param write 写函数，接口同newfs_driver_write（日志提交时为newfs_journal_write）
+ * @return int 写出的段数
+ */
+int newfs_bitmap_flush(struct newfs_bitmap* bm, off_t (*seg_off)(int), void (*write)(off_t, int, uint8_t*))
+{
+	uint8_t* copy = (uint8_t*)malloc(bm->seg_bytes);
+	int cnt = 0;
+
+	pthread_mutex_lock(&bm->flush_lock);
+	for (int i = 0; i < bm->seg_cnt; ++i)
+	{
+		int len = bm->bits / 8 - i * bm->seg_bytes;
+		if (len > bm->seg_bytes)
+			len = bm->seg_bytes;
+
+		pthread_mutex_lock(&bm->lock);
+		int dirty = bm->seg_dirty[i];
+		bm->seg_dirty[i] = 0;
+		if (dirty)
+		{
+			memcpy(copy, bm->map + i * bm->seg_bytes, len);
+			__atomic_sub_fetch(&bm->dirty_cnt, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&bm->lock);
+
+		if (dirty)
+		{
+			write(seg_off(i), len, copy);
+			++cnt;
+		}
+	}
+	pthread_mutex_unlock(&bm->flush_lock);
+	free(copy);
+	return cnt;
+}
@@ -0,0 +1,666 @@
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 全局变量
+*******************************************************************************/
+extern struct newfs_super super;
+
+static struct newfs_buf* bufs;						/* 缓存块数组 */
+static int buf_num;									/* 缓存块数 */
+static struct newfs_buf* hash_tbl[CACHE_HASH_SZ];	/* 块号 -> 缓存块 */
+static struct newfs_buf* lru_head;					/* 最近使用 */
+static struct newfs_buf* lru_tail;					/* 最久未使用，优先淘汰 */
+static unsigned long write_seq;						/* 设备写次数，预读据此判断读到的数据是否已过时 */
+static struct newfs_busy* busy_tbl[CACHE_HASH_SZ];	/* 不持cache_lock做IO的块：直接读写，缓存块的装入、写回 */
+static int wb_cnt;									/* 不持锁进行中的缓存块写回批数 */
+static pthread_cond_t busy_cond = PTHREAD_COND_INITIALIZER;	/* 不持锁的IO完成，或有块解除钉住 */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define HASH(blkno)			((unsigned)(blkno) & (CACHE_HASH_SZ - 1))
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+static void lru_unlink(struct newfs_buf* buf)
+{
+	if (buf->lru_prev)
+		buf->lru_prev->lru_next = buf->lru_next;
+	else
+		lru_head = buf->lru_next;
+	if (buf->lru_next)
+		buf->lru_next->lru_prev = buf->lru_prev;
+	else
+		lru_tail = buf->lru_prev;
+	buf->lru_prev = buf->lru_next = NULL;
+}
+
+static void lru_push_head(struct newfs_buf* buf)
+{
+	buf->lru_prev = NULL;
+	buf->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = buf;
+	lru_head = buf;
+	if (lru_tail == NULL)
+		lru_tail = buf;
+}
+
+static void hash_remove(struct newfs_buf* buf)
+{
+	struct newfs_buf** pp = &hash_tbl[HASH(buf->blkno)];
+	while (*pp && *pp != buf)
+		pp = &(*pp)->hash_next;
+	if (*pp)
+		*pp = buf->hash_next;
+	buf->hash_next = NULL;
+}
+
+static struct newfs_buf* hash_lookup(int blkno)
+{
+	struct newfs_buf* buf = hash_tbl[HASH(blkno)];
+	while (buf && buf->blkno != blkno)
+		buf = buf->hash_next;
+	return buf;
+}
+
+// 块是否在不持锁的IO中；writes_only时只看写
+static int busy_lookup(int blkno, int writes_only)
+{
+	for (struct newfs_busy* b = busy_tbl[HASH(blkno)]; b; b = b->next)
+		if (b->blkno == blkno && (!writes_only || b->rw == NEWFS_IO_WRITE))
+			return 1;
+	return 0;
+}
+
+// 将一批块登记为读写中，之后可释放cache_lock做设备IO。busy由调用者提供，每块一项
+static void busy_mark(struct newfs_busy* busy, const struct newfs_iovec* vec, int cnt, int rw)
+{
+	for (int i = 0; i < cnt; ++i)
+	{
+		busy[i].blkno = vec[i].blkno;
+		busy[i].rw = rw;
+		busy[i].next = busy_tbl[HASH(vec[i].blkno)];
+		busy_tbl[HASH(vec[i].blkno)] = &busy[i];
+	}
+}
+
+// 设备IO完成，撤销登记并唤醒等待这些块的线程
+static void busy_clear(struct newfs_busy* busy, int cnt)
+{
+	for (int i = 0; i < cnt; ++i)
+	{
+		struct newfs_busy** pp = &busy_tbl[HASH(busy[i].blkno)];
+		while (*pp != &busy[i])
+			pp = &(*pp)->next;
+		*pp = busy[i].next;
+	}
+	if (cnt)
+		pthread_cond_broadcast(&busy_cond);
+}
+
+// 淘汰候选：从LRU尾部向前第一个未被日志事务钉住、不在IO中的缓存块，没有时返回NULL
+static struct newfs_buf* lru_victim(void)
+{
+	struct newfs_buf* buf = lru_tail;
+	while (buf && (buf->pinned || buf->busy))
+		buf = buf->lru_prev;
+	return buf;
+}
+
+// 不持cache_lock装入或写回一个缓存块。期间块号登记为忙，其他线程取该块时等待，缓存块不会被淘汰；
+// 返回时已重新持有cache_lock
+static void buf_io(struct newfs_buf* buf, int rw)
+{
+	struct newfs_busy busy;
+	struct newfs_iovec vec = { buf->blkno, buf->data };
+
+	buf->busy = 1;
+	busy_mark(&busy, &vec, 1, rw);
+	if (rw == NEWFS_IO_WRITE)
+		++wb_cnt;
+	pthread_mutex_unlock(&cache_lock);
+
+	newfs_io_submit(&vec, 1, rw);
+
+	pthread_mutex_lock(&cache_lock);
+	if (rw == NEWFS_IO_WRITE)
+	{
+		buf->dirty = 0;
+		++write_seq;
+		--wb_cnt;
+	}
+	else
+		buf->valid = 1;
+	buf->busy = 0;
+	busy_clear(&busy, 1);
+}
+
+// 取淘汰候选victim改挂到blkno下，原内容作废（脏块须由调用者先写回）
+static struct newfs_buf* buf_claim(struct newfs_buf* buf, int blkno)
+{
+	if (buf->blkno >= 0)
+		hash_remove(buf);
+
+	buf->blkno = blkno;
+	buf->valid = 0;
+	buf->dirty = 0;
+	buf->hash_next = hash_tbl[HASH(blkno)];
+	hash_tbl[HASH(blkno)] = buf;
+
+	lru_unlink(buf);
+	lru_push_head(buf);
+	return buf;
+}
+
+/******************************************************************************
+* SECTION: 缓存查找与淘汰（调用者须持有cache_lock）
+*******************************************************************************/
+/**
+ * @brief 取设备块对应的缓存块，未命中时淘汰LRU块（脏则先写回）
+ *
+ * @param blkno 设备块号
+ * @param fill 未命中时是否从磁盘读入；整块覆盖写时传0，省去一次读
+ * @return struct newfs_buf* 缓存块，须持有cache_lock，释放锁后不再有效；
+ * 装入、写回淘汰块及等待其他线程的IO时不持cache_lock
+ */
+static struct newfs_buf* cache_get(int blkno, int fill)
+{
+	struct newfs_buf* buf;
+
+	while (1)
+	{
+		// IO中的块须等其完成，否则可能装入旧内容
+		if (busy_lookup(blkno, 0))
+		{
+			pthread_cond_wait(&busy_cond, &cache_lock);
+			continue;
+		}
+		buf = hash_lookup(blkno);
+		if (buf)
+		{
+			newfs_stats_cache(buf->valid || !fill);
+			break;
+		}
+		struct newfs_buf* victim = lru_victim();
+		// 全部被钉住或在IO中：等事务提交或IO完成。钉住的块不超过JOURNAL_TX_MAX，正常不会发生
+		if (victim == NULL)
+		{
+			pthread_cond_wait(&busy_cond, &cache_lock);
+			continue;
+		}
+		// 脏块写回后重新查找，期间其他线程可能已装入该块
+		if (victim->dirty)
+		{
+			buf_io(victim, NEWFS_IO_WRITE);
+			continue;
+		}
+		newfs_stats_cache(0);
+		buf = buf_claim(victim, blkno);
+		break;
+	}
+	if (fill && !buf->valid)
+		buf_io(buf, NEWFS_IO_READ);
+
+	lru_unlink(buf);
+	lru_push_head(buf);
+	return buf;
+}
+
+/**
+ * @brief 仅查询设备块是否已缓存，不装入、不调整LRU
+ *
+ * @return struct newfs_buf* 含有效数据的缓存块，未缓存返回NULL
+ */
+static struct newfs_buf* cache_peek(int blkno)
+{
+	struct newfs_buf* buf = hash_lookup(blkno);
+	return (buf && buf->valid) ? buf : NULL;
+}
+
+/**
+ * @brief 丢弃设备块的缓存，绕过缓存直接写设备前调用，避免旧内容被写回覆盖
+ */
+static void cache_drop(int blkno)
+{
+	struct newfs_buf* buf = hash_lookup(blkno);
+	if (buf == NULL)
+		return;
+
+	hash_remove(buf);
+	buf->blkno = -1;
+	buf->valid = 0;
+	buf->dirty = 0;
+	if (buf->pinned)
+		pthread_cond_broadcast(&busy_cond);
+	buf->pinned = 0;
+	// 空闲块优先复用
+	lru_unlink(buf);
+	buf->lru_prev = lru_tail;
+	if (lru_tail)
+		lru_tail->lru_next = buf;
+	lru_tail = buf;
+	if (lru_head == NULL)
+		lru_head = buf;
+}
+
+/******************************************************************************
+* SECTION: 块缓存接口
+*******************************************************************************/
+/**
+ * @brief 初始化块缓存，须在super.dev_io_sz确定后调用
+ *
+ * @param blk_num 缓存块数
+ * @return int 0成功，否则失败
+ */
+int newfs_cache_init(int blk_num)
+{
+	bufs = (struct newfs_buf*)calloc(blk_num, sizeof(struct newfs_buf));
+	if (bufs == NULL)
+		return -ENOMEM;
+	buf_num = blk_num;
+	memset(hash_tbl, 0, sizeof(hash_tbl));
+	lru_head = lru_tail = NULL;
+
+	for (int i = 0; i < blk_num; ++i)
+	{
+		bufs[i].blkno = -1;
+		bufs[i].data = (uint8_t*)malloc(super.dev_io_sz);
+		lru_push_head(&bufs[i]);
+	}
+	return 0;
+}
+
+/**
+ * @brief 写回全部脏块并释放块缓存
+ */
+void newfs_cache_destroy(void)
+{
+	newfs_cache_sync();
+	for (int i = 0; i < buf_num; ++i)
+		free(bufs[i].data);
+	free(bufs);
+	bufs = NULL;
+	lru_head = lru_tail = NULL;
+}
+
+/**
+ * @brief 从设备块blkno的off处读出len字节，经由缓存
+ */
+void newfs_cache_read(int blkno, int off, int len, uint8_t* out)
+{
+	pthread_mutex_lock(&cache_lock);
+	struct newfs_buf* buf = cache_get(blkno, 1);
+	memcpy(out, buf->data + off, len);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief 向设备块blkno的off处写入len字节，只写缓存，脏块在淘汰/sync时写回；整块覆盖时不读磁盘
+ */
+void newfs_cache_write(int blkno, int off, int len, const uint8_t* in)
+{
+	pthread_mutex_lock(&cache_lock);
+	struct newfs_buf* buf = cache_get(blkno, len != super.dev_io_sz);
+	memcpy(buf->data + off, in, len);
+	buf->valid = 1;
+	buf->dirty = 1;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief 写元数据块：同newfs_cache_write，并钉住该块直到所属日志事务提交
+ *
+ * @return int 1该块本次新被钉住，调用者须将其记入事务；0已在事务中
+ */
+int newfs_cache_write_pin(int blkno, int off, int len, const uint8_t* in)
+{
+	pthread_mutex_lock(&cache_lock);
+	struct newfs_buf* buf = cache_get(blkno, len != super.dev_io_sz);
+	memcpy(buf->data + off, in, len);
+	buf->valid = 1;
+	buf->dirty = 1;
+	int ret = !buf->pinned;
+	buf->pinned = 1;
+	pthread_mutex_unlock(&cache_lock);
+	return ret;
+}
+
+/**
+ * @brief 事务已写入日志，解除钉住，之后该块按普通脏块写回原位
+ */
+void newfs_cache_unpin(int blkno)
+{
+	pthread_mutex_lock(&cache_lock);
+	struct newfs_buf* buf = hash_lookup(blkno);
+	if (buf)
+		buf->pinned = 0;
+	pthread_cond_broadcast(&busy_cond);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief 整设备块直接读入调用者缓冲区：已缓存的块（可能比磁盘新）从缓存拷贝，其余批量读设备。
+ * 读设备时不持cache_lock，这些块登记为直接读写中，其间其他线程的缓存命中与设备IO照常进行
+ */
+void newfs_cache_read_direct(struct newfs_iovec* vec, int cnt)
+{
+	struct newfs_busy* busy = (struct newfs_busy*)malloc(cnt * sizeof(struct newfs_busy));
+	int dev_cnt = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	// 未缓存的块若正在写回或直接写，须等其落盘后再读设备
+	for (int i = 0; i < cnt; )
+	{
+		if (cache_peek(vec[i].blkno) == NULL && busy_lookup(vec[i].blkno, 1))
+		{
+			pthread_cond_wait(&busy_cond, &cache_lock);
+			i = 0;
+		}
+		else
+			++i;
+	}
+	for (int i = 0; i < cnt; ++i)
+	{
+		struct newfs_buf* buf = cache_peek(vec[i].blkno);
+		newfs_stats_cache(buf != NULL);
+		if (buf)
+			memcpy(vec[i].buf, buf->data, super.dev_io_sz);
+		else
+			vec[dev_cnt++] = vec[i];
+	}
+	busy_mark(busy, vec, dev_cnt, NEWFS_IO_READ);
+	pthread_mutex_unlock(&cache_lock);
+
+	newfs_io_submit(vec, dev_cnt, NEWFS_IO_READ);
+
+	pthread_mutex_lock(&cache_lock);
+	busy_clear(busy, dev_cnt);
+	pthread_mutex_unlock(&cache_lock);
+	free(busy);
+}
+
+/**
+ * @brief 整设备块直接从调用者缓冲区写设备，丢弃这些块的旧缓存。
+ * 写设备时不持cache_lock；完成前这些块不会被重新装入缓存，预读据write_seq丢弃可能过时的结果
+ */
+void newfs_cache_write_direct(struct newfs_iovec* vec, int cnt)
+{
+	struct newfs_busy* busy = (struct newfs_busy*)malloc(cnt * sizeof(struct newfs_busy));
+
+	pthread_mutex_lock(&cache_lock);
+	// 等这些块上进行中的装入、写回完成，否则旧内容可能被装入缓存或晚于本次写入落盘
+	for (int i = 0; i < cnt; )
+	{
+		if (busy_lookup(vec[i].blkno, 0))
+		{
+			pthread_cond_wait(&busy_cond, &cache_lock);
+			i = 0;
+		}
+		else
+			++i;
+	}
+	for (int i = 0; i < cnt; ++i)
+		cache_drop(vec[i].blkno);
+	busy_mark(busy, vec, cnt, NEWFS_IO_WRITE);
+	pthread_mutex_unlock(&cache_lock);
+
+	newfs_io_submit(vec, cnt, NEWFS_IO_WRITE);
+
+	pthread_mutex_lock(&cache_lock);
+	busy_clear(busy, cnt);
+	++write_seq;
+	pthread_mutex_unlock(&cache_lock);
+	free(busy);
+}
+
+/**
+ * @brief 将一组设备块中未缓存的部分一次性读入，被淘汰的脏块也合并写回。
+ * 块号可以不连续、可以重复，读写各一次批量提交，由设备合并相邻块；
+ * IO期间不持cache_lock，涉及的块登记为忙，其他线程取这些块时等待
+ *
+ * @param blknos 设备块号列表
+ * @param cnt 块数，超过缓存容量一半时截断，避免本次读入的块互相淘汰
+ */
+void newfs_cache_fetch(const int* blknos, int cnt)
+{
+	struct newfs_iovec* rvec;
+	struct newfs_iovec* wvec;
+	struct newfs_buf** fill;
+	struct newfs_busy* busy;
+	int rcnt = 0, wcnt = 0;
+
+	if (cnt > buf_num / 2)
+		cnt = buf_num / 2;
+	if (cnt <= 0)
+		return;
+
+	rvec = (struct newfs_iovec*)malloc(cnt * sizeof(struct newfs_iovec));
+	wvec = (struct newfs_iovec*)malloc(cnt * sizeof(struct newfs_iovec));
+	fill = (struct newfs_buf**)malloc(cnt * sizeof(struct newfs_buf*));
+	busy = (struct newfs_busy*)malloc(2 * cnt * sizeof(struct newfs_busy));
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < cnt; ++i)
+	{
+		if (hash_lookup(blknos[i]) || busy_lookup(blknos[i], 0))
+			continue;
+		// 被淘汰块的数据在读入前写出，故可直接引用其缓冲区；没有可淘汰的块时少读一些
+		struct newfs_buf* victim = lru_victim();
+		if (victim == NULL)
+			break;
+		if (victim->dirty)
+		{
+			wvec[wcnt].blkno = victim->blkno;
+			wvec[wcnt].buf = victim->data;
+			++wcnt;
+		}
+		fill[rcnt] = buf_claim(victim, blknos[i]);
+		fill[rcnt]->busy = 1;
+		rvec[rcnt].blkno = blknos[i];
+		rvec[rcnt].buf = fill[rcnt]->data;
+		++rcnt;
+	}
+	busy_mark(busy, wvec, wcnt, NEWFS_IO_WRITE);
+	busy_mark(busy + wcnt, rvec, rcnt, NEWFS_IO_READ);
+	if (wcnt)
+		++wb_cnt;
+	pthread_mutex_unlock(&cache_lock);
+
+	newfs_io_submit(wvec, wcnt, NEWFS_IO_WRITE);
+	newfs_io_submit(rvec, rcnt, NEWFS_IO_READ);
+
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < rcnt; ++i)
+	{
+		fill[i]->valid = 1;
+		fill[i]->busy = 0;
+	}
+	busy_clear(busy, wcnt + rcnt);
+	if (wcnt)
+	{
+		++write_seq;
+		--wb_cnt;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	free(rvec);
+	free(wvec);
+	free(fill);
+	free(busy);
+}
+
+/**
+ * @brief 将连续若干设备块中未缓存的部分一次性读入，见newfs_cache_fetch
+ *
+ * @param blkno 起始设备块号
+ * @param cnt 块数
+ */
+void newfs_cache_prefetch(int blkno, int cnt)
+{
+	int* blknos;
+
+	if (cnt > buf_num / 2)
+		cnt = buf_num / 2;
+	if (cnt <= 1)
+		return;
+
+	blknos = (int*)malloc(cnt * sizeof(int));
+	for (int i = 0; i < cnt; ++i)
+		blknos[i] = blkno + i;
+	newfs_cache_fetch(blknos, cnt);
+	free(blknos);
+}
+
+/**
+ * @brief 预读：不持锁读设备到私有缓冲区，再把仍未缓存的块装入缓存。
+ * 若读设备期间有任何设备写发生，读到的数据可能已过时，整批丢弃
+ *
+ * @param blkno 起始设备块号
+ * @param cnt 块数，超过缓存容量四分之一时截断
+ */
+void newfs_cache_readahead(int blkno, int cnt)
+{
+	struct newfs_iovec* vec;
+	uint8_t* data;
+	unsigned long seq;
+	int rcnt = 0;
+
+	if (cnt > buf_num / 4)
+		cnt = buf_num / 4;
+	if (cnt <= 0)
+		return;
+
+	vec = (struct newfs_iovec*)malloc(cnt * sizeof(struct newfs_iovec));
+	data = (uint8_t*)malloc(cnt * super.dev_io_sz);
+
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < cnt; ++i)
+	{
+		if (hash_lookup(blkno + i) || busy_lookup(blkno + i, 0))
+			continue;
+		vec[rcnt].blkno = blkno + i;
+		vec[rcnt].buf = data + rcnt * super.dev_io_sz;
+		++rcnt;
+	}
+	seq = write_seq;
+	pthread_mutex_unlock(&cache_lock);
+
+	if (rcnt == 0)
+		goto out;
+	newfs_io_submit(vec, rcnt, NEWFS_IO_READ);
+
+	pthread_mutex_lock(&cache_lock);
+	if (seq == write_seq)
+	{
+		for (int i = 0; i < rcnt; ++i)
+		{
+			if (hash_lookup(vec[i].blkno) || busy_lookup(vec[i].blkno, 0))
+				continue;
+			// 预读不为装入而写回脏块，淘汰候选是脏块时余下的不再装入
+			struct newfs_buf* victim = lru_victim();
+			if (victim == NULL || victim->dirty)
+				break;
+			struct newfs_buf* buf = buf_claim(victim, vec[i].blkno);
+			memcpy(buf->data, vec[i].buf, super.dev_io_sz);
+			buf->valid = 1;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+out:
+	free(vec);
+	free(data);
+}
+
+/**
+ * @brief 将所有脏块按块号排序后批量写回磁盘；未提交事务钉住的块跳过。
+ * 写设备时不持cache_lock，这些块登记为忙；先等其他线程进行中的写回，返回时此前的脏块均已落盘
+ *
+ * @return int 写回的块数
+ */
+int newfs_cache_sync(void)
+{
+	struct newfs_iovec* vec = (struct newfs_iovec*)malloc(buf_num * sizeof(struct newfs_iovec));
+	struct newfs_buf** wb = (struct newfs_buf**)malloc(buf_num * sizeof(struct newfs_buf*));
+	struct newfs_busy* busy = (struct newfs_busy*)malloc(buf_num * sizeof(struct newfs_busy));
+	int cnt = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	while (wb_cnt > 0)
+		pthread_cond_wait(&busy_cond, &cache_lock);
+	for (int i = 0; i < buf_num; ++i)
+	{
+		if (bufs[i].dirty && !bufs[i].pinned && !bufs[i].busy)
+		{
+			vec[cnt].blkno = bufs[i].blkno;
+			vec[cnt].buf = bufs[i].data;
+			wb[cnt] = &bufs[i];
+			bufs[i].busy = 1;
+			++cnt;
+		}
+	}
+	busy_mark(busy, vec, cnt, NEWFS_IO_WRITE);
+	if (cnt)
+		++wb_cnt;
+	pthread_mutex_unlock(&cache_lock);
+
+	newfs_io_submit(vec, cnt, NEWFS_IO_WRITE);
+
+	pthread_mutex_lock(&cache_lock);
+	for (int i = 0; i < cnt; ++i)
+	{
+		wb[i]->dirty = 0;
+		wb[i]->busy = 0;
+	}
+	busy_clear(busy, cnt);
+	if (cnt)
+	{
+		++write_seq;
+		--wb_cnt;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	free(vec);
+	free(wb);
+	free(busy);
+	return cnt;
+}
+
+/******************************************************************************
+* SECTION: 按字节偏移读写，跨越的设备块逐块经由缓存
+*******************************************************************************/
+// 读出驱动磁盘块，经由块缓存
+void newfs_driver_read(off_t offset, int size, uint8_t* out)
+{
+	int blkno = (int)(offset / super.dev_io_sz);
+	int bias = (int)(offset % super.dev_io_sz);
+
+	// 跨多块时先把未命中的块一次性批量读入
+	newfs_cache_prefetch(blkno, CEIL((size + bias), super.dev_io_sz));
+
+	while (size > 0)
+	{
+		int len = super.dev_io_sz - bias < size ? super.dev_io_sz - bias : size;
+		newfs_cache_read(blkno, bias, len, out);
+
+		out += len;
+		size -= len;
+		bias = 0;
+		++blkno;
+	}
+}
+
+// 写入驱动磁盘块，经由块缓存，脏块在淘汰/fsync/umount时写回
+void newfs_driver_write(off_t offset, int size, uint8_t* in)
+{
+	int blkno = (int)(offset / super.dev_io_sz);
+	int bias = (int)(offset % super.dev_io_sz);
+
+	while (size > 0)
+	{
+		int len = super.dev_io_sz - bias < size ? super.dev_io_sz - bias : size;
+		newfs_cache_write(blkno, bias, len, in);
+
+		in += len;
+		size -= len;
+		bias = 0;
+		++blkno;
+	}
+}
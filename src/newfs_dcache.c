@@ -0,0 +1,120 @@
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 路径缓存（dcache），完整路径 -> parse()结果，含不存在路径的负缓存
+* 查找不加锁：槽中存放不可变的缓存项指针，以原子操作替换；被替换下的缓存项
+* 交给newfs_retire延迟释放，故查找者读到的缓存项在本次操作期间始终有效
+*******************************************************************************/
+struct dcache_entry {
+	struct newfs_dentry* dentry;	/* parse()返回的目录项（负缓存时为最深命中的上级） */
+	int find_flag;					/* 0为负缓存：路径不存在 */
+	char path[];					/* 完整路径 */
+};
+
+static struct dcache_entry* dcache[DCACHE_SZ];	/* 直接映射，冲突时覆盖 */
+static unsigned long dcache_gen;				/* 每次失效加一，插入前后比对，防止并发插入过时结果 */
+
+static unsigned int path_hash(const char* path)
+{
+	unsigned int h = 2166136261u;
+	while (*path)
+	{
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return h & (DCACHE_SZ - 1);
+}
+
+// 若槽中仍是e则清空，并延迟释放e
+static void slot_remove(struct dcache_entry** slot, struct dcache_entry* e)
+{
+	if (__atomic_compare_exchange_n(slot, &e, NULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		newfs_retire(e);
+}
+
+/**
+ * @brief 查路径缓存，一次哈希探测
+ *
+ * @param path 完整路径
+ * @param find_flag 命中时返回路径是否存在
+ * @return struct newfs_dentry* 命中返回缓存的目录项，未命中返回NULL
+ */
+struct newfs_dentry* newfs_dcache_lookup(const char* path, int* find_flag)
+{
+	struct dcache_entry* e = __atomic_load_n(&dcache[path_hash(path)], __ATOMIC_ACQUIRE);
+	int hit = e && !strcmp(e->path, path);
+
+	newfs_stats_dcache(hit);
+	if (!hit)
+		return NULL;
+	*find_flag = e->find_flag;
+	return e->dentry;
+}
+
+/**
+ * @brief 当前失效计数，parse()开始查找前取得，插入时传回
+ */
+unsigned long newfs_dcache_gen(void)
+{
+	return __atomic_load_n(&dcache_gen, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief 记录parse()结果；查找期间发生过失效则不记录
+ *
+ * @param gen 查找开始前newfs_dcache_gen()的返回值
+ */
+void newfs_dcache_insert(const char* path, struct newfs_dentry* dentry, int find_flag, unsigned long gen)
+{
+	struct dcache_entry** slot = &dcache[path_hash(path)];
+	struct dcache_entry* e;
+	struct dcache_entry* old;
+
+	if (newfs_dcache_gen() != gen)
+		return;
+	e = (struct dcache_entry*)malloc(sizeof(struct dcache_entry) + strlen(path) + 1);
+	e->dentry = dentry;
+	e->find_flag = find_flag;
+	strcpy(e->path, path);
+
+	old = __atomic_exchange_n(slot, e, __ATOMIC_ACQ_REL);
+	if (old)
+		newfs_retire(old);
+	// 与失效并发：失效若已扫描过本槽，由插入者自己撤回
+	if (newfs_dcache_gen() != gen)
+		slot_remove(slot, e);
+}
+
+/**
+ * @brief 创建、删除、重命名path后调用，使path本身及其下所有路径的缓存失效。
+ * 目录项地址不随目录扩容移动，其他路径的缓存仍然有效，只有以path为前缀的负缓存会过时
+ *
+ * @param path 被创建/删除/重命名的完整路径
+ */
+void newfs_dcache_invalidate(const char* path)
+{
+	size_t len = strlen(path);
+
+	__atomic_add_fetch(&dcache_gen, 1, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < DCACHE_SZ; ++i)
+	{
+		struct dcache_entry* e = __atomic_load_n(&dcache[i], __ATOMIC_ACQUIRE);
+		if (e == NULL)
+			continue;
+		if (!strncmp(e->path, path, len) && (e->path[len] == '\0' || e->path[len] == '/'))
+			slot_remove(&dcache[i], e);
+	}
+}
+
+/**
+ * @brief 清空路径缓存并立即释放，须独占持有目录树锁
+ */
+void newfs_dcache_clear(void)
+{
+	__atomic_add_fetch(&dcache_gen, 1, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < DCACHE_SZ; ++i)
+	{
+		free(dcache[i]);
+		dcache[i] = NULL;
+	}
+}
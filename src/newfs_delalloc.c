@@ -0,0 +1,386 @@
+#include "newfs.h"
+#include <time.h>
+
+/******************************************************************************
+* SECTION: 全局变量
+*******************************************************************************/
+extern struct newfs_super super;
+
+static struct newfs_inode* da_head;		/* 脏inode链表 */
+static int da_pages;					/* 已预留未分配的块数：全部缓冲块，及其落盘后所需的extent块 */
+static time_t da_oldest;				/* 最早一个缓冲块的产生时间，0表示无缓冲 */
+static pthread_mutex_t da_lock = PTHREAD_MUTEX_INITIALIZER;	/* 保护以上各项；各inode的缓冲块由inode锁保护 */
+
+static int da_stop;						/* 通知定时落盘线程退出 */
+static int da_running;
+static pthread_t da_thread;
+static pthread_cond_t da_cond = PTHREAD_COND_INITIALIZER;
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+// 返回lblk >= 目标的第一个缓冲块下标
+static int dpage_find(struct newfs_inode* inode, int lblk)
+{
+	int lo = 0, hi = inode->dpage_cnt;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (inode->dpages[mid].lblk < lblk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// 归还n个缓冲块的预留；inode已无缓冲块时连同预留的extent块一并归还
+static void da_release(struct newfs_inode* inode, int n)
+{
+	if (inode->dpage_cnt == 0)
+	{
+		n += inode->da_leaf;
+		inode->da_leaf = 0;
+	}
+	pthread_mutex_lock(&da_lock);
+	da_pages -= n;
+	if (da_pages == 0)
+		da_oldest = 0;
+	pthread_mutex_unlock(&da_lock);
+}
+
+static void dpage_free_from(struct newfs_inode* inode, int i)
+{
+	int n = inode->dpage_cnt - i;
+	for (int k = i; k < inode->dpage_cnt; ++k)
+		free(inode->dpages[k].data);
+	inode->dpage_cnt = i;
+	da_release(inode, n);
+}
+
+// 须持有da_lock
+static void da_unlink(struct newfs_inode* inode)
+{
+	if (!inode->da_dirty)
+		return;
+	if (inode->da_prev)
+		inode->da_prev->da_next = inode->da_next;
+	else
+		da_head = inode->da_next;
+	if (inode->da_next)
+		inode->da_next->da_prev = inode->da_prev;
+	inode->da_prev = inode->da_next = NULL;
+	inode->da_dirty = 0;
+}
+
+// 为[first, first + cnt)这段逻辑连续的缓冲块一次分配数据块并批量写出，返回成功写出的块数
+static int dpage_write_run(struct newfs_inode* inode, struct newfs_dpage* pages, int cnt)
+{
+	int io_sz = super.dev_io_sz;
+	int got = newfs_extent_alloc(inode, pages[0].lblk, cnt);
+	struct newfs_iovec* vec = (struct newfs_iovec*)malloc(got * 2 * sizeof(struct newfs_iovec));
+
+	for (int i = 0; i < got; ++i)
+	{
+		int devblk = newfs_blk_off(&super, newfs_bmap(inode, pages[i].lblk, NULL)) / io_sz;
+		vec[2 * i].blkno = devblk;
+		vec[2 * i].buf = pages[i].data;
+		vec[2 * i + 1].blkno = devblk + 1;
+		vec[2 * i + 1].buf = pages[i].data + io_sz;
+	}
+	newfs_cache_write_direct(vec, got * 2);
+	free(vec);
+	return got;
+}
+
+// 缓冲块过多或驻留过久
+static int da_pressure(void)
+{
+	pthread_mutex_lock(&da_lock);
+	int ret = da_pages > DA_MAX_PAGES || (da_oldest && time(NULL) - da_oldest >= DA_EXPIRE_SEC);
+	pthread_mutex_unlock(&da_lock);
+	return ret;
+}
+
+// 定时落盘线程：每秒检查一次缓冲是否驻留过久
+static void* da_worker(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&da_lock);
+	while (!da_stop)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&da_cond, &da_lock, &ts);
+		if (da_stop)
+			break;
+		pthread_mutex_unlock(&da_lock);
+		newfs_da_balance();
+		pthread_mutex_lock(&da_lock);
+	}
+	pthread_mutex_unlock(&da_lock);
+	return NULL;
+}
+
+/******************************************************************************
+* SECTION: 延迟分配接口
+*******************************************************************************/
+/**
+ * @brief 向尚未分配数据块的文件块写入，内容暂存于inode的缓冲块中，不分配、不写设备。
+ * 新建缓冲块时预留一个数据块及落盘后可能需要的extent块，并确认extent数不超上限，
+ * 落盘时因而不会失败。须独占持有inode锁
+ *
+ * @param inode 文件inode
+ * @param lblk 逻辑块号，调用者保证其为空洞
+ * @param off 块内偏移
+ * @param len 字节数，off + len不超过一个数据块
+ * @param in 写入内容
+ * @return int 0成功，-ENOSPC空间不足，-EFBIG文件的extent已达上限
+ */
+int newfs_da_write(struct newfs_inode* inode, int lblk, int off, int len, const uint8_t* in)
+{
+	int blk_sz = 2 * super.dev_io_sz;
+	int i = dpage_find(inode, lblk);
+
+	if (i == inode->dpage_cnt || inode->dpages[i].lblk != lblk)
+	{
+		// 最坏情况下每个缓冲块落盘后各成一个extent；放不下时先落盘本文件，按实际extent数重算
+		int leaf = newfs_extent_room(inode, inode->dpage_cnt + 1);
+		if (leaf < 0 && inode->dpage_cnt > 0)
+		{
+			int ret = newfs_da_flush(inode);
+			if (ret < 0)
+				return ret;
+			i = 0;
+			leaf = newfs_extent_room(inode, 1);
+		}
+		if (leaf < 0)
+			return leaf;
+
+		// 数据块连同尚未预留的extent块一并预留
+		int rsv = 1 + (leaf > inode->da_leaf ? leaf - inode->da_leaf : 0);
+		pthread_mutex_lock(&da_lock);
+		if (newfs_bitmap_free_cnt(&super.data_bm) - da_pages < rsv)
+		{
+			pthread_mutex_unlock(&da_lock);
+			// 截断释放的块要等所在事务提交后才归还
+			if (newfs_journal_freeing() == 0)
+				return -ENOSPC;
+			newfs_journal_commit();
+			return newfs_da_write(inode, lblk, off, len, in);
+		}
+		if (da_oldest == 0)
+			da_oldest = time(NULL);
+		da_pages += rsv;
+		pthread_mutex_unlock(&da_lock);
+		inode->da_leaf += rsv - 1;
+
+		if (inode->dpage_cnt == inode->dpage_cap)
+		{
+			inode->dpage_cap = inode->dpage_cap ? inode->dpage_cap * 2 : 16;
+			inode->dpages = (struct newfs_dpage*)realloc(inode->dpages, inode->dpage_cap * sizeof(struct newfs_dpage));
+		}
+		memmove(inode->dpages + i + 1, inode->dpages + i, (inode->dpage_cnt - i) * sizeof(struct newfs_dpage));
+		inode->dpages[i].lblk = lblk;
+		inode->dpages[i].data = (uint8_t*)calloc(1, blk_sz);
+		++inode->dpage_cnt;
+	}
+	memcpy(inode->dpages[i].data + off, in, len);
+	newfs_da_dirty(inode);
+	return 0;
+}
+
+/**
+ * @brief 从缓冲块读出
+ *
+ * @return int 1命中，0该块未缓冲（调用者按空洞处理）
+ */
+int newfs_da_read(struct newfs_inode* inode, int lblk, int off, int len, uint8_t* out)
+{
+	int i = dpage_find(inode, lblk);
+	if (i == inode->dpage_cnt || inode->dpages[i].lblk != lblk)
+		return 0;
+	memcpy(out, inode->dpages[i].data + off, len);
+	return 1;
+}
+
+/**
+ * @brief 将inode挂入脏inode链表，其size/映射/时间在落盘时一并写回
+ */
+void newfs_da_dirty(struct newfs_inode* inode)
+{
+	pthread_mutex_lock(&da_lock);
+	if (!inode->da_dirty)
+	{
+		inode->da_dirty = 1;
+		inode->da_prev = NULL;
+		inode->da_next = da_head;
+		if (da_head)
+			da_head->da_prev = inode;
+		da_head = inode;
+	}
+	pthread_mutex_unlock(&da_lock);
+}
+
+/**
+ * @brief 落盘：逻辑连续的缓冲块合为一段，每段一次分配连续数据块并批量写出；
+ * 分配按DA_FLUSH_BLKS块拆成多个事务，每个事务末尾写回inode。
+ * 数据块先于记录其分配的日志事务写出，重放后不会指向未写的块。
+ * 写入时已预留数据块与extent块，分配不会失败；若仍失败（预留被破坏），丢弃放不下的块并报错。
+ * 须独占持有inode锁
+ *
+ * @return int 0成功，-ENOSPC有数据未能写下
+ */
+int newfs_da_flush(struct newfs_inode* inode)
+{
+	int ret = 0;
+
+	if (!inode->da_dirty)
+		return 0;
+
+	// 每个事务至多分配DA_FLUSH_BLKS个数据块，预留按每块各占一个位图段、extent块全部改动估计。
+	// 没有缓冲块时也写回inode（覆盖写只改了修改时间）
+	int i = 0;
+	do
+	{
+		newfs_journal_begin(JOURNAL_INODE_CREDITS + DA_FLUSH_BLKS + INODE_EXTENT_NUM);
+		for (int quota = DA_FLUSH_BLKS; quota > 0 && i < inode->dpage_cnt; )
+		{
+			int n = 1;
+			while (n < quota && i + n < inode->dpage_cnt && inode->dpages[i + n].lblk == inode->dpages[i].lblk + n)
+				++n;
+			int got = dpage_write_run(inode, inode->dpages + i, n);
+			if (got < n)
+			{
+				fprintf(stderr, "newfs: ino %d lost %d delayed blocks: no space\n", inode->ino, n - got);
+				ret = -ENOSPC;
+			}
+			i += n;
+			quota -= n;
+		}
+		newfs_inode_sync(inode);
+		newfs_journal_end();
+	} while (i < inode->dpage_cnt);
+	dpage_free_from(inode, 0);
+	free(inode->dpages);
+	inode->dpages = NULL;
+	inode->dpage_cap = 0;
+	pthread_mutex_lock(&da_lock);
+	da_unlink(inode);
+	pthread_mutex_unlock(&da_lock);
+	return ret;
+}
+
+/**
+ * @brief 全部脏inode落盘，须独占持有目录树锁（或已无其他线程）
+ */
+void newfs_da_flush_all(void)
+{
+	while (1)
+	{
+		pthread_mutex_lock(&da_lock);
+		struct newfs_inode* inode = da_head;
+		pthread_mutex_unlock(&da_lock);
+		if (inode == NULL)
+			break;
+		newfs_da_flush(inode);
+	}
+}
+
+/**
+ * @brief 文件截短时丢弃逻辑块号 >= lblk 的缓冲块，并清零lblk - 1块中tail之后的部分
+ *
+ * @param tail 新文件大小在末块内的偏移，0表示末块完整保留
+ */
+void newfs_da_truncate(struct newfs_inode* inode, int lblk, int tail)
+{
+	int blk_sz = 2 * super.dev_io_sz;
+	int i = dpage_find(inode, lblk);
+
+	dpage_free_from(inode, i);
+	if (tail && i > 0 && inode->dpages[i - 1].lblk == lblk - 1)
+		memset(inode->dpages[i - 1].data + tail, 0, blk_sz - tail);
+}
+
+/**
+ * @brief 缓冲块过多或驻留过久时独占目录树锁全部落盘；写操作结束后及定时落盘线程调用，
+ * 调用者不得持有任何锁
+ */
+void newfs_da_balance(void)
+{
+	if (!da_pressure())
+		return;
+	newfs_tree_lock(1);
+	if (da_pressure())
+		newfs_da_flush_all();
+	newfs_tree_unlock();
+}
+
+/**
+ * @brief 已预留未分配的数据块数，statfs从空闲数中扣除
+ */
+int newfs_da_reserved(void)
+{
+	pthread_mutex_lock(&da_lock);
+	int ret = da_pages;
+	pthread_mutex_unlock(&da_lock);
+	return ret;
+}
+
+/**
+ * @brief 立即分配数据块（如目录块）之前占用n个未被预留的空闲块，防止挤占延迟分配的预留；
+ * 分配完成后以newfs_da_unclaim归还
+ *
+ * @return int 0成功，-ENOSPC未预留的空闲块不足
+ */
+int newfs_da_claim(int n)
+{
+	int ret = 0;
+	pthread_mutex_lock(&da_lock);
+	if (newfs_bitmap_free_cnt(&super.data_bm) - da_pages < n)
+		ret = -ENOSPC;
+	else
+		da_pages += n;
+	pthread_mutex_unlock(&da_lock);
+	return ret;
+}
+
+/**
+ * @brief 归还newfs_da_claim占用的块数，此时块已分配（或放弃分配）
+ */
+void newfs_da_unclaim(int n)
+{
+	pthread_mutex_lock(&da_lock);
+	da_pages -= n;
+	pthread_mutex_unlock(&da_lock);
+}
+
+/**
+ * @brief 启动定时落盘线程
+ *
+ * @return int 0成功，否则失败（此时只在写操作后检查驻留时间）
+ */
+int newfs_da_start(void)
+{
+	da_stop = 0;
+	if (pthread_create(&da_thread, NULL, da_worker, NULL) != 0)
+		return -EAGAIN;
+	da_running = 1;
+	return 0;
+}
+
+/**
+ * @brief 等待定时落盘线程退出，卸载时在全部落盘之前调用
+ */
+void newfs_da_stop(void)
+{
+	if (!da_running)
+		return;
+	pthread_mutex_lock(&da_lock);
+	da_stop = 1;
+	pthread_cond_signal(&da_cond);
+	pthread_mutex_unlock(&da_lock);
+	pthread_join(da_thread, NULL);
+	da_running = 0;
+}
@@ -0,0 +1,157 @@
+#include "newfs.h"
+#include <assert.h>
+
+/******************************************************************************
+* SECTION: 全局变量
+*******************************************************************************/
+extern struct newfs_super super;
+
+/******************************************************************************
+* SECTION: 目录哈希索引（文件名 -> inode->dentrys下标），开放寻址、线性探测
+*******************************************************************************/
+#define DIR_INDEX_MIN_SZ	16
+
+// FNV-1a
+static unsigned int name_hash(const char* name)
+{
+	unsigned int h = 2166136261u;
+	while (*name)
+	{
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void index_insert(int* tbl, int sz, const char* name, int slot)
+{
+	unsigned int i = name_hash(name) & (sz - 1);
+	while (tbl[i] >= 0)
+		i = (i + 1) & (sz - 1);
+	tbl[i] = slot;
+}
+
+/**
+ * @brief 为目录inode按当前dentrys重建哈希索引，负载因子保持在1/2以下
+ *
+ * @param inode 目录inode
+ */
+void newfs_dir_index_build(struct newfs_inode* inode)
+{
+	int sz = DIR_INDEX_MIN_SZ;
+	while (sz < 2 * (inode->dir_cnt + 1))
+		sz <<= 1;
+
+	free(inode->dir_index);
+	inode->dir_index = (int*)malloc(sz * sizeof(int));
+	inode->dir_index_sz = sz;
+	memset(inode->dir_index, -1, sz * sizeof(int));
+
+	for (int i = 0; i < inode->dir_cnt; ++i)
+		index_insert(inode->dir_index, sz, inode->dentrys[i]->name, i);
+}
+
+/**
+ * @brief 目录追加目录项后更新索引，须在dentrys与dir_cnt更新之后调用
+ *
+ * @param inode 目录inode
+ * @param slot 新目录项在dentrys中的下标
+ */
+void newfs_dir_index_add(struct newfs_inode* inode, int slot)
+{
+	if (inode->dir_index == NULL || 2 * inode->dir_cnt > inode->dir_index_sz)
+		newfs_dir_index_build(inode);
+	else
+		index_insert(inode->dir_index, inode->dir_index_sz, inode->dentrys[slot]->name, slot);
+}
+
+/**
+ * @brief 在目录中按名查找目录项，只读索引，持有目录的共享锁即可
+ *
+ * @param inode 目录inode
+ * @param name 文件名
+ * @return struct newfs_dentry* 命中的目录项，未命中返回NULL
+ */
+struct newfs_dentry* newfs_dir_lookup(struct newfs_inode* inode, const char* name)
+{
+	if (inode->dir_cnt == 0)
+		return NULL;
+	// 索引在装入目录（dentry_load）与追加目录项时于独占锁下建立，这里只读
+	assert(inode->dir_index != NULL);
+
+	int sz = inode->dir_index_sz;
+	unsigned int i = name_hash(name) & (sz - 1);
+	while (inode->dir_index[i] >= 0)
+	{
+		struct newfs_dentry* obj = inode->dentrys[inode->dir_index[i]];
+		if (!strcmp(obj->name, name))
+			return obj;
+		i = (i + 1) & (sz - 1);
+	}
+	return NULL;
+}
+
+/**
+ * @brief 释放目录哈希索引
+ */
+void newfs_dir_index_free(struct newfs_inode* inode)
+{
+	free(inode->dir_index);
+	inode->dir_index = NULL;
+	inode->dir_index_sz = 0;
+}
+
+/******************************************************************************
+* SECTION: 目录块的磁盘格式：变长的newfs_dirent
+*******************************************************************************/
+/**
+ * @brief 目录项在磁盘上占用的字节数
+ */
+int newfs_dirent_len(const char* name)
+{
+	return DIRENT_LEN((int)strlen(name));
+}
+
+/**
+ * @brief 将目录项编码为磁盘格式
+ *
+ * @param buf 至少newfs_dirent_len(dentry->name)字节
+ */
+void newfs_dirent_encode(const struct newfs_dentry* dentry, uint8_t* buf)
+{
+	memset(buf, 0, newfs_dirent_len(dentry->name));
+	struct newfs_dirent* de = (struct newfs_dirent*)buf;
+	de->ino = dentry->ino;
+	de->ftype = dentry->ftype;
+	de->name_len = strlen(dentry->name);
+	memcpy(de->name, dentry->name, de->name_len);
+}
+
+/**
+ * @brief 解析一个目录数据块
+ *
+ * @param blk 数据块内容
+ * @param used 块内有效字节数，末块为目录大小的余数
+ * @param out 解析出的目录项，inode指针置空
+ * @param max out最多容纳的项数
+ * @return int 解析出的目录项数
+ */
+int newfs_dirent_decode(const uint8_t* blk, int used, struct newfs_dentry* out, int max)
+{
+	int n = 0;
+
+	for (int pos = 0; pos + DIRENT_HDR_SZ <= used && n < max; )
+	{
+		const struct newfs_dirent* de = (const struct newfs_dirent*)(blk + pos);
+		// 文件名过长只可能是损坏的目录块，按块尾处理
+		if (de->name_len == 0 || de->name_len >= MAX_NAME_LEN || pos + DIRENT_HDR_SZ + de->name_len > used)
+			break;
+		memset(out + n, 0, sizeof(struct newfs_dentry));
+		out[n].ino = de->ino;
+		out[n].ftype = (FILE_TYPE)de->ftype;
+		memcpy(out[n].name, de->name, de->name_len);
+		++n;
+		pos += DIRENT_LEN(de->name_len);
+	}
+	return n;
+}
@@ -0,0 +1,286 @@
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 全局变量
+*******************************************************************************/
+extern struct newfs_super super;
+
+/******************************************************************************
+* SECTION: extent映射
+* extent少于等于INODE_EXTENT_NUM个时直接存于inode（depth 0）；超出时全部存入extent块，
+* inode中的extents[]改存索引项（depth 1）：lblk为该块首个extent的逻辑块号，
+* pblk为extent块号，len为该块中的extent数。内存中ext_map始终保存全部extent
+*******************************************************************************/
+#define EXTENTS_PER_BLK()	(2 * super.dev_io_sz / (int)sizeof(struct newfs_extent))
+
+// 返回lblk <= 目标的最后一个extent下标，没有则返回-1
+static int ext_find(struct newfs_inode* inode, int lblk)
+{
+	int lo = 0, hi = inode->extent_cnt - 1, ret = -1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (inode->ext_map[mid].lblk <= lblk)
+		{
+			ret = mid;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+	return ret;
+}
+
+// 保证extent块足以容纳n个extent，不足时分配；超出上限或无空闲块返回-ENOSPC
+static int ext_reserve(struct newfs_inode* inode, int n)
+{
+	int need = n <= INODE_EXTENT_NUM ? 0 : CEIL(n, EXTENTS_PER_BLK());
+	if (need > INODE_EXTENT_NUM)
+		return -ENOSPC;
+
+	for (int i = 0; i < need; ++i)
+	{
+		if (inode->ext_leaf[i] != 0)
+			continue;
+		int bno = newfs_bitmap_alloc(&super.data_bm, newfs_group_goal(inode));
+		if (bno < 0)
+			return -ENOSPC;
+		inode->ext_leaf[i] = bno;
+	}
+	return 0;
+}
+
+// 插入extent [lblk, lblk + len) -> pblk，能与前后extent衔接时合并
+static int ext_insert(struct newfs_inode* inode, int lblk, int pblk, int len)
+{
+	int i = ext_find(inode, lblk);
+	struct newfs_extent* map = inode->ext_map;
+
+	inode->ext_dirty = 1;
+	if (i >= 0 && map[i].lblk + map[i].len == lblk && map[i].pblk + map[i].len == pblk)
+	{
+		map[i].len += len;
+		// 填补空洞后可能与后一个extent相接
+		if (i + 1 < inode->extent_cnt && map[i].lblk + map[i].len == map[i + 1].lblk
+			&& map[i].pblk + map[i].len == map[i + 1].pblk)
+		{
+			map[i].len += map[i + 1].len;
+			memmove(map + i + 1, map + i + 2, (inode->extent_cnt - i - 2) * sizeof(struct newfs_extent));
+			--inode->extent_cnt;
+		}
+		return 0;
+	}
+	if (i + 1 < inode->extent_cnt && lblk + len == map[i + 1].lblk && pblk + len == map[i + 1].pblk)
+	{
+		map[i + 1].lblk = lblk;
+		map[i + 1].pblk = pblk;
+		map[i + 1].len += len;
+		return 0;
+	}
+
+	if (ext_reserve(inode, inode->extent_cnt + 1) < 0)
+		return -ENOSPC;
+	if (inode->extent_cnt == inode->ext_cap)
+	{
+		inode->ext_cap *= 2;
+		inode->ext_map = (struct newfs_extent*)realloc(inode->ext_map, inode->ext_cap * sizeof(struct newfs_extent));
+		map = inode->ext_map;
+	}
+	memmove(map + i + 2, map + i + 1, (inode->extent_cnt - i - 1) * sizeof(struct newfs_extent));
+	map[i + 1].lblk = lblk;
+	map[i + 1].pblk = pblk;
+	map[i + 1].len = len;
+	++inode->extent_cnt;
+	return 0;
+}
+
+/******************************************************************************
+* SECTION: extent接口
+*******************************************************************************/
+/**
+ * @brief 将inode的全部extent读入内存，inode首次用到块映射时调用
+ */
+void newfs_extent_load(struct newfs_inode* inode)
+{
+	int cnt = inode->extent_cnt;
+
+	inode->ext_cap = cnt > INODE_EXTENT_NUM ? cnt : INODE_EXTENT_NUM;
+	inode->ext_map = (struct newfs_extent*)malloc(inode->ext_cap * sizeof(struct newfs_extent));
+	inode->ext_dirty = 0;
+	memset(inode->ext_leaf, 0, sizeof(inode->ext_leaf));
+
+	if (inode->extent_depth == 0)
+	{
+		memcpy(inode->ext_map, inode->extents, cnt * sizeof(struct newfs_extent));
+		return;
+	}
+	for (int i = 0, n = 0; i < INODE_EXTENT_NUM && n < cnt; ++i)
+	{
+		struct newfs_extent* idx = &inode->extents[i];
+		inode->ext_leaf[i] = idx->pblk;
+		newfs_driver_read(newfs_blk_off(&super, idx->pblk), idx->len * sizeof(struct newfs_extent),
+						  (uint8_t*)(inode->ext_map + n));
+		n += idx->len;
+	}
+}
+
+/**
+ * @brief 将内存中的extent写回inode及extent块，释放多余的extent块；inode本身由调用者写回
+ */
+void newfs_extent_sync(struct newfs_inode* inode)
+{
+	int per = EXTENTS_PER_BLK();
+	int n = inode->extent_cnt;
+	int need = n <= INODE_EXTENT_NUM ? 0 : CEIL(n, per);
+
+	if (inode->ext_map == NULL || !inode->ext_dirty)
+		return;
+
+	for (int i = need; i < INODE_EXTENT_NUM; ++i)
+	{
+		if (inode->ext_leaf[i] != 0)
+		{
+			// 该块之后可能用作数据块，日志中的旧映像不得再重放
+			int devblk = newfs_blk_off(&super, inode->ext_leaf[i]) / super.dev_io_sz;
+			newfs_journal_revoke(devblk);
+			newfs_journal_revoke(devblk + 1);
+			newfs_bitmap_free(&super.data_bm, inode->ext_leaf[i]);
+			inode->ext_leaf[i] = 0;
+		}
+	}
+
+	memset(inode->extents, 0, sizeof(inode->extents));
+	inode->extent_depth = need > 0;
+	if (need == 0)
+		memcpy(inode->extents, inode->ext_map, n * sizeof(struct newfs_extent));
+	for (int i = 0; i < need; ++i)
+	{
+		int m = n - i * per < per ? n - i * per : per;
+		inode->extents[i].lblk = inode->ext_map[i * per].lblk;
+		inode->extents[i].pblk = inode->ext_leaf[i];
+		inode->extents[i].len = m;
+		newfs_journal_write(newfs_blk_off(&super, inode->ext_leaf[i]), m * sizeof(struct newfs_extent),
+							(uint8_t*)(inode->ext_map + i * per));
+	}
+	inode->ext_dirty = 0;
+}
+
+/**
+ * @brief 释放内存中的extent
+ */
+void newfs_extent_free(struct newfs_inode* inode)
+{
+	free(inode->ext_map);
+	inode->ext_map = NULL;
+}
+
+/**
+ * @brief 逻辑块号映射到data区块号
+ *
+ * @param inode 文件inode
+ * @param lblk 逻辑块号
+ * @param run 非NULL时返回从lblk起映射连续（或空洞连续）的块数
+ * @return int data区块号，空洞返回0（0号块固定存放根目录项，不会分给文件）
+ */
+int newfs_bmap(struct newfs_inode* inode, int lblk, int* run)
+{
+	if (inode->ext_map == NULL)
+		newfs_extent_load(inode);
+
+	int i = ext_find(inode, lblk);
+	if (i >= 0 && lblk < inode->ext_map[i].lblk + inode->ext_map[i].len)
+	{
+		struct newfs_extent* e = &inode->ext_map[i];
+		if (run)
+			*run = e->lblk + e->len - lblk;
+		return e->pblk + lblk - e->lblk;
+	}
+	if (run)
+		*run = i + 1 < inode->extent_cnt ? inode->ext_map[i + 1].lblk - lblk : INT_MAX;
+	return 0;
+}
+
+/**
+ * @brief 为[lblk, lblk + cnt)中的空洞分配数据块，每段空洞尽量紧接前一块之后连续分配
+ *
+ * @return int 从lblk起已有映射的连续块数，小于cnt表示空间不足
+ */
+int newfs_extent_alloc(struct newfs_inode* inode, int lblk, int cnt)
+{
+	int done = 0;
+
+	while (done < cnt)
+	{
+		int cur = lblk + done;
+		int run;
+		int left = cnt - done;
+		if (newfs_bmap(inode, cur, &run))
+		{
+			done += run < left ? run : left;
+			continue;
+		}
+
+		int want = run < left ? run : left;
+		int prev = cur > 0 ? newfs_bmap(inode, cur - 1, NULL) : 0;
+		int got;
+		int pblk = newfs_bitmap_alloc_run(&super.data_bm, prev ? prev + 1 : newfs_group_goal(inode), want, &got);
+		if (pblk < 0)
+			break;
+		if (ext_insert(inode, cur, pblk, got) < 0)
+		{
+			for (int i = 0; i < got; ++i)
+				newfs_journal_free(pblk + i);
+			break;
+		}
+		done += got;
+	}
+	return done;
+}
+
+/**
+ * @brief 再增加n个extent（不计合并）时还需分配的extent块数，供分配前预留
+ *
+ * @return int 需新分配的extent块数，超出inode的extent上限返回-EFBIG
+ */
+int newfs_extent_room(struct newfs_inode* inode, int n)
+{
+	if (inode->ext_map == NULL)
+		newfs_extent_load(inode);
+
+	int total = inode->extent_cnt + n;
+	int need = total <= INODE_EXTENT_NUM ? 0 : CEIL(total, EXTENTS_PER_BLK());
+	int missing = 0;
+	if (need > INODE_EXTENT_NUM)
+		return -EFBIG;
+	for (int i = 0; i < need; ++i)
+		if (inode->ext_leaf[i] == 0)
+			++missing;
+	return missing;
+}
+
+/**
+ * @brief 释放逻辑块号 >= lblk 的全部数据块，所在事务提交后才可重新分配；须在begin/end之间
+ */
+void newfs_extent_truncate(struct newfs_inode* inode, int lblk)
+{
+	if (inode->ext_map == NULL)
+		newfs_extent_load(inode);
+
+	while (inode->extent_cnt > 0)
+	{
+		struct newfs_extent* e = &inode->ext_map[inode->extent_cnt - 1];
+		if (e->lblk + e->len <= lblk)
+			break;
+
+		int keep = lblk > e->lblk ? lblk - e->lblk : 0;
+		for (int i = keep; i < e->len; ++i)
+			newfs_journal_free(e->pblk + i);
+		inode->ext_dirty = 1;
+		if (keep > 0)
+		{
+			e->len = keep;
+			break;
+		}
+		--inode->extent_cnt;
+	}
+}
@@ -0,0 +1,244 @@
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 全局变量
+*******************************************************************************/
+extern struct newfs_super super;
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+static int64_t ts_to_ns(struct timespec ts)
+{
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct timespec ns_to_ts(int64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	return ts;
+}
+
+/******************************************************************************
+* SECTION: inode的磁盘格式
+*******************************************************************************/
+/**
+ * @brief 内存inode -> 磁盘记录；只拷贝磁盘上有意义的字段，访问计数、锁等内存状态可能正被其他线程改动
+ */
+void newfs_inode_serialize(const struct newfs_inode* inode, struct newfs_dinode* d)
+{
+	memset(d, 0, sizeof(struct newfs_dinode));
+	d->ino = inode->ino;
+	d->size = inode->size;
+	d->ftype = inode->ftype;
+	d->nlink = inode->nlink;
+	d->dir_cnt = inode->dir_cnt;
+	d->extent_cnt = inode->extent_cnt;
+	d->extent_depth = inode->extent_depth;
+	d->atime = ts_to_ns(inode->atime);
+	d->mtime = ts_to_ns(inode->mtime);
+	d->ctime = ts_to_ns(inode->ctime);
+	memcpy(d->extents, inode->extents, sizeof(d->extents));
+}
+
+/**
+ * @brief 磁盘记录 -> 内存inode，只填写磁盘上的字段，其余内存状态由调用者初始化
+ */
+void newfs_inode_deserialize(struct newfs_inode* inode, const struct newfs_dinode* d)
+{
+	inode->ino = d->ino;
+	inode->size = d->size;
+	inode->ftype = (FILE_TYPE)d->ftype;
+	inode->nlink = d->nlink;
+	inode->dir_cnt = d->dir_cnt;
+	inode->extent_cnt = d->extent_cnt;
+	inode->extent_depth = d->extent_depth;
+	inode->atime = ns_to_ts(d->atime);
+	inode->mtime = ns_to_ts(d->mtime);
+	inode->ctime = ns_to_ts(d->ctime);
+	memcpy(inode->extents, d->extents, sizeof(inode->extents));
+}
+
+// 将inode（含extent）写回磁盘，经日志记录，须在newfs_journal_begin/end之间
+void newfs_inode_sync(struct newfs_inode* inode)
+{
+	struct newfs_dinode disk;
+
+	newfs_extent_sync(inode);
+	newfs_inode_serialize(inode, &disk);
+	newfs_journal_write(newfs_ino_off(&super, inode->ino), sizeof(disk), (uint8_t*)&disk);
+}
+
+/**
+ * @brief 在文件[offset, offset + size)与buf之间传输数据。整设备块直接与buf收发并批量提交，
+ * 不经中间缓冲；首尾不足一个设备块的部分经块缓存中转。读时空洞（块号0）先查延迟分配缓冲，
+ * 没有则读出全0；写时调用者保证范围内均已分配
+ *
+ * @return int 0成功
+ */
+static int file_io(struct newfs_inode* inode, uint8_t* buf, int size, int offset, int rw)
+{
+	int io_sz = super.dev_io_sz;
+	int blk_sz = 2 * io_sz;
+	int end = offset + size;
+	struct newfs_iovec* vec = (struct newfs_iovec*)malloc((size / io_sz + 2) * sizeof(struct newfs_iovec));
+	int cnt = 0;
+
+	int run_lblk = -1, run_end = -1, run_pblk = 0;
+	for (int pos = offset; pos < end; )
+	{
+		int len = io_sz - pos % io_sz;
+		if (len > end - pos)
+			len = end - pos;
+		// 一次映射得到一段连续块，段内无需再查extent
+		int lblk = pos / blk_sz;
+		if (lblk >= run_end)
+		{
+			int run;
+			run_pblk = newfs_bmap(inode, lblk, &run);
+			run_lblk = lblk;
+			run_end = run > INT_MAX - lblk ? INT_MAX : lblk + run;
+		}
+		int bno = run_pblk ? run_pblk + lblk - run_lblk : 0;
+		uint8_t* p = buf + (pos - offset);
+		off_t dev_off = newfs_blk_off(&super, bno) + pos % blk_sz;
+
+		if (bno == 0)
+		{
+			if (!newfs_da_read(inode, lblk, pos % blk_sz, len, p))
+				memset(p, 0, len);
+		}
+		else if (len < io_sz)
+		{
+			if (rw == NEWFS_IO_READ)
+				newfs_driver_read(dev_off, len, p);
+			else
+				newfs_driver_write(dev_off, len, p);
+		}
+		else
+		{
+			vec[cnt].blkno = dev_off / io_sz;
+			vec[cnt].buf = p;
+			++cnt;
+		}
+		pos += len;
+	}
+
+	if (rw == NEWFS_IO_READ)
+		newfs_cache_read_direct(vec, cnt);
+	else
+		newfs_cache_write_direct(vec, cnt);
+	free(vec);
+	return 0;
+}
+
+/******************************************************************************
+* SECTION: 文件读写接口
+*******************************************************************************/
+/**
+ * @brief 读文件
+ *
+ * @return int 读出的字节数
+ */
+int newfs_file_read(struct newfs_inode* inode, char* buf, size_t size, off_t offset)
+{
+	if (offset >= inode->size)
+		return 0;
+	if ((off_t)(offset + size) > inode->size)
+		size = inode->size - offset;
+
+	file_io(inode, (uint8_t*)buf, size, offset, NEWFS_IO_READ);
+	return size;
+}
+
+/**
+ * @brief 写文件：已分配的块直接写，空洞写入延迟分配缓冲，待落盘时再连续分配；
+ * size在内存中更新，随inode落盘写回。空间不足时只写能写下的部分
+ *
+ * @return int 写入的字节数，一个字节都写不下时返回出错原因（-EFBIG、-ENOSPC等）
+ */
+int newfs_file_write(struct newfs_inode* inode, const char* buf, size_t size, off_t offset)
+{
+	int blk_sz = 2 * super.dev_io_sz;
+	off_t end = offset + size;
+	off_t pos = offset;
+	int err = 0;
+
+	if (size == 0)
+		return 0;
+	if (end > INT_MAX)
+		return -EFBIG;
+
+	while (pos < end)
+	{
+		int lblk = pos / blk_sz;
+		int run;
+		int pblk = newfs_bmap(inode, lblk, &run);
+		off_t run_end = (off_t)lblk * blk_sz + (off_t)run * blk_sz;
+		if (run_end > end)
+			run_end = end;
+
+		if (pblk)
+		{
+			file_io(inode, (uint8_t*)buf + (pos - offset), run_end - pos, pos, NEWFS_IO_WRITE);
+			pos = run_end;
+			continue;
+		}
+		while (pos < run_end)
+		{
+			int off = pos % blk_sz;
+			int len = blk_sz - off < run_end - pos ? blk_sz - off : run_end - pos;
+			if ((err = newfs_da_write(inode, pos / blk_sz, off, len, (const uint8_t*)buf + (pos - offset))) < 0)
+				goto out;
+			pos += len;
+		}
+	}
+out:
+	// 一个字节都没写下时返回首个错误
+	if (pos == offset)
+		return err;
+	if (pos > inode->size)
+		inode->size = pos;
+	// 修改时间随inode落盘写回
+	clock_gettime(CLOCK_REALTIME, &inode->mtime);
+	inode->ctime = inode->mtime;
+	newfs_da_dirty(inode);
+	return pos - offset;
+}
+
+/**
+ * @brief 改变文件大小，缩小时释放多余数据块并清零末块尾部
+ *
+ * @return int 0成功，否则失败
+ */
+int newfs_file_truncate(struct newfs_inode* inode, off_t len)
+{
+	int blk_sz = 2 * super.dev_io_sz;
+
+	if (len > INT_MAX)
+		return -EFBIG;
+
+	newfs_journal_begin(JOURNAL_INODE_CREDITS);
+	if (len < inode->size)
+	{
+		newfs_extent_truncate(inode, CEIL(len, blk_sz));
+		// 保证之后扩展时读出的是0
+		int tail = len % blk_sz;
+		newfs_da_truncate(inode, CEIL(len, blk_sz), tail);
+		int bno = tail ? newfs_bmap(inode, len / blk_sz, NULL) : 0;
+		if (bno)
+		{
+			uint8_t* zero = (uint8_t*)calloc(1, blk_sz - tail);
+			newfs_driver_write(newfs_blk_off(&super, bno) + tail, blk_sz - tail, zero);
+			free(zero);
+		}
+	}
+	inode->size = len;
+	clock_gettime(CLOCK_REALTIME, &inode->mtime);
+	inode->ctime = inode->mtime;
+	newfs_inode_sync(inode);
+	newfs_journal_end();
+	return 0;
+}
@@ -0,0 +1,309 @@
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 格式化
+* 由设备大小与每inode字节数推出布局：超级块 | 日志 | 块组0 | 块组1 | ...，
+* 每组为 inode位图 | data位图 | inode表 | data区。
+* 只依赖ddriver，直接写设备不经块缓存，mkfs.newfs与挂载时的自动格式化共用
+*******************************************************************************/
+// 将buf的blks个设备块写到设备块号blkno处
+static int dev_write(int fd, int io_sz, int blkno, const uint8_t* buf, int blks)
+{
+	if (ddriver_seek(fd, (off_t)blkno * io_sz, SEEK_SET) < 0)
+		return -EIO;
+	for (int i = 0; i < blks; ++i)
+		if (ddriver_write(fd, (char*)buf + i * io_sz, io_sz) < 0)
+			return -EIO;
+	return 0;
+}
+
+// 写blks个全0设备块，每次一个块，避免大块内存
+static int dev_zero(int fd, int io_sz, int blkno, int blks)
+{
+	uint8_t* zero = (uint8_t*)calloc(1, io_sz);
+	int ret = ddriver_seek(fd, (off_t)blkno * io_sz, SEEK_SET) < 0 ? -EIO : 0;
+	for (int i = 0; i < blks && ret == 0; ++i)
+		if (ddriver_write(fd, (char*)zero, io_sz) < 0)
+			ret = -EIO;
+	free(zero);
+	return ret;
+}
+
+/**
+ * @brief 查询设备字节数。先用64位的IOC_REQ_DEVICE_SIZE64，驱动不支持时退回int的
+ * IOC_REQ_DEVICE_SIZE
+ *
+ * @return off_t 设备字节数，失败返回-EFBIG（设备超出int且驱动只支持int）或-EIO
+ */
+off_t newfs_dev_size(int fd)
+{
+	int64_t sz64;
+	int sz;
+
+	if (ddriver_ioctl(fd, IOC_REQ_DEVICE_SIZE64, &sz64) == 0)
+		return sz64;
+	if (ddriver_ioctl(fd, IOC_REQ_DEVICE_SIZE, &sz) < 0)
+		return errno == EFBIG ? -EFBIG : -EIO;
+	return sz;
+}
+
+/**
+ * @brief 计算布局，只填写sb中的布局字段。超级块与日志之后按块组切分，每组的data区恰为
+ * 一个设备块的位图所能覆盖的块数；最后一组不足时缩小，小于8块则舍去
+ *
+ * @param disk_sz 设备字节数；设备块号为int，设备至多INT_MAX个IO单位
+ * @param io_sz 设备IO单位
+ * @param bytes_per_inode 每多少字节设备空间配一个inode
+ * @return int 0成功，-ENOSPC设备太小，-EFBIG设备块数超出int
+ */
+int newfs_geometry(struct newfs_super* sb, off_t disk_sz, int io_sz, int bytes_per_inode)
+{
+	if (disk_sz / io_sz > INT_MAX)
+		return -EFBIG;
+	int total = (int)(disk_sz / io_sz);
+	int super_blks = CEIL(NEWFS_DSUPER_SZ, io_sz);
+
+	if (bytes_per_inode < 2 * io_sz)
+		bytes_per_inode = 2 * io_sz;
+	sb->bytes_per_inode = bytes_per_inode;
+	sb->dev_io_sz = io_sz;
+
+	// 日志随设备增大，太小的设备不启用
+	int journal_blks = total / 128;
+	if (journal_blks < JOURNAL_BLKS)
+		journal_blks = JOURNAL_BLKS;
+	if (journal_blks > JOURNAL_MAX_BLKS)
+		journal_blks = JOURNAL_MAX_BLKS;
+	if (journal_blks > total / 4)
+		journal_blks = 0;
+
+	// 每组inode数按一整组的data区估算，设备不足一组时按设备大小；位数取8的倍数，位图按字节整存
+	int bpg = io_sz * 8;
+	off_t span = (off_t)bpg * 2 * io_sz < disk_sz ? (off_t)bpg * 2 * io_sz : disk_sz;
+	int ipg = (int)(span / bytes_per_inode) / 8 * 8;
+	if (ipg < 8)
+		ipg = 8;
+	if (ipg > io_sz * 8)
+		ipg = io_sz * 8;
+	int itable_blks = CEIL(ipg * NEWFS_DINODE_SZ, io_sz);
+	int meta = 2 + itable_blks;
+	int group_blks = meta + 2 * bpg;
+
+	int left = total - super_blks - journal_blks;
+	if (left <= 0)
+		return -ENOSPC;
+	int groups = left / group_blks;
+	int rest = left % group_blks;
+	int last = rest > meta ? (rest - meta) / 2 / 8 * 8 : 0;
+	if (last >= 8)
+		++groups;
+	else
+		last = 0;
+	if (groups == 0)
+		return -ENOSPC;
+
+	sb->group_cnt = groups;
+	sb->inodes_per_group = ipg;
+	sb->blocks_per_group = bpg;
+	sb->group_blks = group_blks;
+	sb->itable_blks = itable_blks;
+	sb->max_ino = groups * ipg;
+	sb->max_data = last ? (groups - 1) * bpg + last : groups * bpg;
+
+	sb->journal_offset = (off_t)super_blks * io_sz;
+	sb->journal_blks = journal_blks;
+	sb->group_offset = sb->journal_offset + (off_t)journal_blks * io_sz;
+	sb->map_inode_blks = groups;
+	sb->map_data_blks = groups;
+	sb->map_inode_offset = sb->group_offset;
+	sb->map_data_offset = sb->group_offset + io_sz;
+	sb->inode_offset = sb->group_offset + 2 * io_sz;
+	sb->data_offset = sb->group_offset + (off_t)meta * io_sz;
+	return 0;
+}
+
+/******************************************************************************
+* SECTION: 超级块的磁盘格式
+*******************************************************************************/
+/**
+ * @brief 内存超级块 -> 磁盘记录，只拷贝布局参数
+ */
+void newfs_super_serialize(const struct newfs_super* sb, struct newfs_dsuper* d)
+{
+	memset(d, 0, sizeof(struct newfs_dsuper));
+	d->magic = sb->magic;
+	d->features = sb->features;
+	d->io_sz = sb->dev_io_sz;
+	d->max_ino = sb->max_ino;
+	d->max_data = sb->max_data;
+	d->bytes_per_inode = sb->bytes_per_inode;
+	d->journal_offset = sb->journal_offset;
+	d->journal_blks = sb->journal_blks;
+	d->group_cnt = sb->group_cnt;
+	d->inodes_per_group = sb->inodes_per_group;
+	d->blocks_per_group = sb->blocks_per_group;
+	d->group_blks = sb->group_blks;
+	d->group_offset = sb->group_offset;
+	d->itable_blks = sb->itable_blks;
+}
+
+/**
+ * @brief 磁盘记录 -> 内存超级块，填写布局参数并推出0号组各部分的位置；
+ * 设备信息与位图等运行时状态不变。io_sz须由调用者与设备核对
+ */
+void newfs_super_deserialize(struct newfs_super* sb, const struct newfs_dsuper* d)
+{
+	int io_sz = d->io_sz;
+
+	sb->magic = d->magic;
+	sb->features = d->features;
+	sb->max_ino = d->max_ino;
+	sb->max_data = d->max_data;
+	sb->bytes_per_inode = d->bytes_per_inode;
+	sb->journal_offset = d->journal_offset;
+	sb->journal_blks = d->journal_blks;
+	sb->group_cnt = d->group_cnt;
+	sb->inodes_per_group = d->inodes_per_group;
+	sb->blocks_per_group = d->blocks_per_group;
+	sb->group_blks = d->group_blks;
+	sb->group_offset = d->group_offset;
+	sb->itable_blks = d->itable_blks;
+
+	sb->map_inode_blks = d->group_cnt;
+	sb->map_data_blks = d->group_cnt;
+	sb->map_inode_offset = d->group_offset;
+	sb->map_data_offset = d->group_offset + io_sz;
+	sb->inode_offset = d->group_offset + 2 * io_sz;
+	sb->data_offset = d->group_offset + (off_t)(2 + d->itable_blks) * io_sz;
+}
+
+/******************************************************************************
+* SECTION: 布局映射
+*******************************************************************************/
+// 第g组的起始磁盘偏移
+static off_t group_off(const struct newfs_super* sb, int g)
+{
+	return sb->group_offset + (off_t)g * sb->group_blks * sb->dev_io_sz;
+}
+
+/**
+ * @brief inode在inode表中的磁盘偏移
+ */
+off_t newfs_ino_off(const struct newfs_super* sb, int ino)
+{
+	return group_off(sb, ino / sb->inodes_per_group) + 2 * sb->dev_io_sz
+		+ ino % sb->inodes_per_group * NEWFS_DINODE_SZ;
+}
+
+/**
+ * @brief 数据块的磁盘偏移
+ */
+off_t newfs_blk_off(const struct newfs_super* sb, int bno)
+{
+	return group_off(sb, bno / sb->blocks_per_group) + (2 + sb->itable_blks) * sb->dev_io_sz
+		+ (off_t)(bno % sb->blocks_per_group) * 2 * sb->dev_io_sz;
+}
+
+/**
+ * @brief 从bno起在磁盘上连续的数据块数，即到所在块组末尾为止
+ */
+int newfs_blk_contig(const struct newfs_super* sb, int bno)
+{
+	int end = (bno / sb->blocks_per_group + 1) * sb->blocks_per_group;
+
+	return (end < sb->max_data ? end : sb->max_data) - bno;
+}
+
+/**
+ * @brief inode位图第seg段的磁盘偏移，每组一段
+ */
+off_t newfs_imap_off(const struct newfs_super* sb, int seg)
+{
+	return group_off(sb, seg);
+}
+
+/**
+ * @brief data位图第seg段的磁盘偏移，段大小为一个设备块，即第seg组
+ */
+off_t newfs_dmap_off(const struct newfs_super* sb, int seg)
+{
+	return group_off(sb, seg) + sb->dev_io_sz;
+}
+
+/**
+ * @brief 格式化设备：写超级块、只含根目录的位图、根inode与根目录项，清空日志区
+ *
+ * @param fd 已打开的ddriver设备
+ * @param sb 返回布局
+ * @return int 0成功，否则失败
+ */
+int newfs_format(int fd, off_t disk_sz, int io_sz, int bytes_per_inode, struct newfs_super* sb)
+{
+	int ret;
+	uint8_t* blk;
+
+	memset(sb, 0, sizeof(struct newfs_super));
+	if ((ret = newfs_geometry(sb, disk_sz, io_sz, bytes_per_inode)) < 0)
+		return ret;
+	sb->magic = NEWFS_MAGIC;
+	sb->features = NEWFS_FEAT_REQUIRED;
+	sb->dev_io_sz = io_sz;
+	sb->dev_disk_sz = disk_sz;
+
+	// 各组位图清零，根目录占0号inode与0号数据块
+	for (int g = 0; g < sb->group_cnt; ++g)
+	{
+		if ((ret = dev_zero(fd, io_sz, newfs_imap_off(sb, g) / io_sz, 1)) < 0
+			|| (ret = dev_zero(fd, io_sz, newfs_dmap_off(sb, g) / io_sz, 1)) < 0)
+			return ret;
+	}
+	blk = (uint8_t*)calloc(1, 2 * io_sz);
+	blk[0] = 1;
+	if ((ret = dev_write(fd, io_sz, newfs_imap_off(sb, 0) / io_sz, blk, 1)) < 0
+		|| (ret = dev_write(fd, io_sz, newfs_dmap_off(sb, 0) / io_sz, blk, 1)) < 0)
+		goto out;
+
+	// 根inode，所在块其余inode的位图位为0，内容无意义
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(blk, 0, io_sz);
+	struct newfs_dinode* root = (struct newfs_dinode*)blk;
+	root->ino = 0;
+	root->ftype = DIR;
+	root->nlink = 2;
+	root->atime = root->mtime = root->ctime = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	if ((ret = dev_write(fd, io_sz, newfs_ino_off(sb, 0) / io_sz, blk, 1)) < 0)
+		goto out;
+
+	// 根目录项存放于0号数据块，其后以空项头结束
+	memset(blk, 0, io_sz);
+	struct newfs_dirent* root_dir = (struct newfs_dirent*)blk;
+	root_dir->ino = 0;
+	root_dir->ftype = DIR;
+	root_dir->name_len = 1;
+	root_dir->name[0] = '/';
+	if ((ret = dev_write(fd, io_sz, newfs_blk_off(sb, 0) / io_sz, blk, 1)) < 0)
+		goto out;
+
+	// 日志区清零，旧文件系统残留的事务不会被误认；再写空日志的超级块
+	if (sb->journal_blks > 0)
+	{
+		if ((ret = dev_zero(fd, io_sz, sb->journal_offset / io_sz, sb->journal_blks)) < 0)
+			goto out;
+		memset(blk, 0, io_sz);
+		struct newfs_jsuper* js = (struct newfs_jsuper*)blk;
+		js->magic = JSUPER_MAGIC;
+		js->seq = 1;
+		js->tail = 1;
+		if ((ret = dev_write(fd, io_sz, sb->journal_offset / io_sz, blk, 1)) < 0)
+			goto out;
+	}
+
+	// 超级块最后写，中途失败不会留下看似有效的文件系统
+	memset(blk, 0, io_sz);
+	newfs_super_serialize(sb, (struct newfs_dsuper*)blk);
+	ret = dev_write(fd, io_sz, 0, blk, CEIL(NEWFS_DSUPER_SZ, io_sz));
+out:
+	free(blk);
+	return ret;
+}
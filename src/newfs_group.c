@@ -0,0 +1,138 @@
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 全局变量
+*******************************************************************************/
+extern struct newfs_super super;
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+// 各组空闲inode数与空闲数据块数，位图的段即块组
+static int group_ifree(int g)
+{
+	return newfs_bitmap_seg_free(&super.inode_bm, g);
+}
+
+static int group_bfree(int g)
+{
+	return newfs_bitmap_seg_free(&super.data_bm, g);
+}
+
+// 按段读入位图，各组的位图块在磁盘上不连续
+static void map_load(uint8_t* map, int bytes, int seg_bytes, off_t (*seg_off)(int))
+{
+	for (int off = 0; off < bytes; off += seg_bytes)
+	{
+		int len = bytes - off < seg_bytes ? bytes - off : seg_bytes;
+		newfs_driver_read(seg_off(off / seg_bytes), len, map + off);
+	}
+}
+
+// 目录：在空闲inode不少于平均数的组中选空闲数据块最多的（相同时取空闲inode多的），
+// 使各目录分散、各自留有扩展余地
+static int find_group_dir(void)
+{
+	int avg = newfs_bitmap_free_cnt(&super.inode_bm) / super.group_cnt;
+	int best = -1;
+
+	for (int g = 0; g < super.group_cnt; ++g)
+	{
+		if (group_ifree(g) == 0 || group_ifree(g) < avg)
+			continue;
+		if (best < 0 || group_bfree(g) > group_bfree(best)
+			|| (group_bfree(g) == group_bfree(best) && group_ifree(g) > group_ifree(best)))
+			best = g;
+	}
+	return best;
+}
+
+// 文件：优先父目录所在组，其次二次探测同时有空闲inode与数据块的组，最后线性查找任一有空闲inode的组
+static int find_group_other(int parent)
+{
+	int cnt = super.group_cnt;
+	int g = parent;
+
+	if (group_ifree(g) && group_bfree(g))
+		return g;
+	for (int i = 1; i < cnt; i <<= 1)
+	{
+		g = (g + i) % cnt;
+		if (group_ifree(g) && group_bfree(g))
+			return g;
+	}
+	for (int i = 1; i < cnt; ++i)
+	{
+		g = (parent + i) % cnt;
+		if (group_ifree(g))
+			return g;
+	}
+	return -1;
+}
+
+/******************************************************************************
+* SECTION: 块组接口
+*******************************************************************************/
+/**
+ * @brief 读入inode位图与data位图并初始化分配器，日志重放之后调用
+ */
+void newfs_group_load(void)
+{
+	int io_sz = super.dev_io_sz;
+	int ino_seg = super.inodes_per_group / 8;
+
+	super.map_inode = (uint8_t*)malloc(super.max_ino / 8);
+	map_load(super.map_inode, super.max_ino / 8, ino_seg, newfs_group_imap_off);
+	super.map_data = (uint8_t*)malloc(super.max_data / 8);
+	map_load(super.map_data, super.max_data / 8, io_sz, newfs_group_dmap_off);
+	newfs_bitmap_init(&super.inode_bm, super.map_inode, super.max_ino, ino_seg);
+	newfs_bitmap_init(&super.data_bm, super.map_data, super.max_data, io_sz);
+}
+
+/**
+ * @brief inode位图第seg段的磁盘偏移，供newfs_bitmap_flush使用
+ */
+off_t newfs_group_imap_off(int seg)
+{
+	return newfs_imap_off(&super, seg);
+}
+
+/**
+ * @brief data位图第seg段的磁盘偏移，供newfs_bitmap_flush使用
+ */
+off_t newfs_group_dmap_off(int seg)
+{
+	return newfs_dmap_off(&super, seg);
+}
+
+/**
+ * @brief inode所在的块组
+ */
+int newfs_group_of_ino(int ino)
+{
+	return ino / super.inodes_per_group;
+}
+
+/**
+ * @brief 为新inode挑选块组并分配inode号
+ *
+ * @param parent 父目录inode
+ * @param type 新inode的类型，目录与文件的选组策略不同
+ * @return int inode号，满时返回-ENOSPC
+ */
+int newfs_group_ialloc(struct newfs_inode* parent, FILE_TYPE type)
+{
+	int g = type == DIR ? find_group_dir() : find_group_other(newfs_group_of_ino(parent->ino));
+	// 计数不加锁读取，选中的组可能已被并发分配用完，此时位图从该组起向后查找
+	return newfs_bitmap_alloc(&super.inode_bm, g < 0 ? -1 : g * super.inodes_per_group);
+}
+
+/**
+ * @brief 文件没有可接续的前一块时数据块的分配目标：inode所在块组data区的起点
+ *
+ * @return int 目标块号
+ */
+int newfs_group_goal(struct newfs_inode* inode)
+{
+	return newfs_group_of_ino(inode->ino) * super.blocks_per_group;
+}
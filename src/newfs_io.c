@@ -0,0 +1,112 @@
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 全局变量
+*******************************************************************************/
+extern struct newfs_super super;
+extern struct custom_options newfs_options;
+
+static long io_head = -1;						/* 设备磁头所在块号，-1表示未知 */
+static __thread struct ddriver_state io_stat_before;	/* 本次操作开始时的设备计数；多线程挂载时计数含并发操作的IO，精确统计须加-s */
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;	/* seek与读写须成对执行 */
+
+/******************************************************************************
+* SECTION: 批量IO
+*******************************************************************************/
+static int iovec_cmp(const void* a, const void* b)
+{
+	const struct newfs_iovec* x = (const struct newfs_iovec*)a;
+	const struct newfs_iovec* y = (const struct newfs_iovec*)b;
+	return (x->blkno > y->blkno) - (x->blkno < y->blkno);
+}
+
+/**
+ * @brief 批量读写设备块：按块号排序，相邻块合并为一段连续传输，
+ * 每段至多一次seek；若某段恰好从磁头当前位置开始，则连seek也省去。
+ * 设备提供ddriver_submit时整批一次提交，由设备合并相邻块、各段并发传输
+ *
+ * @param vec 段列表，每段为一个设备块及其缓冲区，块号不得重复，调用后顺序被打乱
+ * @param cnt 段数
+ * @param rw NEWFS_IO_READ 或 NEWFS_IO_WRITE
+ * @return int 实际seek次数
+ */
+int newfs_io_submit(struct newfs_iovec* vec, int cnt, int rw)
+{
+	int seeks = 0;
+	int total = cnt;
+
+	if (cnt > 1)
+		qsort(vec, cnt, sizeof(struct newfs_iovec), iovec_cmp);
+
+	pthread_mutex_lock(&io_lock);
+	if (ddriver_submit && cnt > 0)
+	{
+		struct ddriver_req* reqs = (struct ddriver_req*)malloc(cnt * sizeof(struct ddriver_req));
+		for (int i = 0; i < cnt; ++i)
+		{
+			reqs[i].offset = (off_t)vec[i].blkno * super.dev_io_sz;
+			reqs[i].buf = (char*)vec[i].buf;
+			if (io_head != vec[i].blkno)
+				++seeks;
+			io_head = vec[i].blkno + 1;
+		}
+		ddriver_submit(super.fd, reqs, cnt, rw == NEWFS_IO_WRITE);
+		free(reqs);
+		cnt = 0;
+	}
+	for (int i = 0; i < cnt; ++i)
+	{
+		if (io_head != vec[i].blkno)
+		{
+			ddriver_seek(super.fd, (off_t)vec[i].blkno * super.dev_io_sz, SEEK_SET);
+			++seeks;
+		}
+		if (rw == NEWFS_IO_READ)
+			ddriver_read(super.fd, (char*)vec[i].buf, super.dev_io_sz);
+		else
+			ddriver_write(super.fd, (char*)vec[i].buf, super.dev_io_sz);
+		io_head = vec[i].blkno + 1;
+	}
+	pthread_mutex_unlock(&io_lock);
+	if (total)
+		newfs_stats_io(rw == NEWFS_IO_READ ? total : 0, rw == NEWFS_IO_WRITE ? total : 0, seeks);
+	return seeks;
+}
+
+/**
+ * @brief 设备被重新打开或被其他途径移动磁头后，须调用此函数使磁头位置失效
+ */
+void newfs_io_reset(void)
+{
+	io_head = -1;
+}
+
+/******************************************************************************
+* SECTION: IO计数报告
+*******************************************************************************/
+/**
+ * @brief FUSE操作开始，记录设备计数（--io-stat开启时）
+ */
+void newfs_io_stat_begin(void)
+{
+	if (newfs_options.io_stat)
+		ddriver_ioctl(super.fd, IOC_REQ_DEVICE_STATE, &io_stat_before);
+}
+
+/**
+ * @brief FUSE操作结束，输出本次操作引起的设备seek/读/写次数（--io-stat开启时）
+ *
+ * @param op 操作名
+ */
+void newfs_io_stat_end(const char* op)
+{
+	struct ddriver_state after;
+
+	if (!newfs_options.io_stat)
+		return;
+	ddriver_ioctl(super.fd, IOC_REQ_DEVICE_STATE, &after);
+	fprintf(stderr, "[io-stat] %-8s seek %d read %d write %d\n", op,
+			after.seek_cnt - io_stat_before.seek_cnt,
+			after.read_cnt - io_stat_before.read_cnt,
+			after.write_cnt - io_stat_before.write_cnt);
+}
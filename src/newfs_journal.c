@@ -0,0 +1,602 @@
+#include "newfs.h"
+#include <time.h>
+
+/******************************************************************************
+* SECTION: 元数据日志（WAL）
+* 元数据操作在newfs_journal_begin/end之间经newfs_journal_write写块缓存，被写的设备块
+* 钉在缓存中并记入当前事务。提交线程每隔JOURNAL_COMMIT_MS把期间所有操作合成一个事务，
+* 以描述块+块映像+提交块一次顺序写入环形日志区，之后这些块才作为普通脏块写回原位。
+* 检查点是懒惰的：日志区将满时才把缓存脏块全部写回原位并清空日志。
+* 挂载时重放tail之后校验通过的事务。
+* 位图只记录改动过的段；设备太小、没有日志区时，提交即把改动过的段写回原位。
+* 释放的数据块先挂在事务上，事务写入日志后才归还分配器：否则提交前就可能被重新分配
+* 并直接写入数据，崩溃后重放的inode会指向别的文件的内容
+*******************************************************************************/
+extern struct newfs_super super;
+
+static int j_enabled;					/* 磁盘上有日志区 */
+static int j_start;						/* 日志区起始设备块号 */
+static int j_blks;						/* 日志区设备块数，第0块为日志超级块 */
+static int j_head;						/* 下一事务的写入位置（日志区内块号） */
+static int j_used;						/* 上次检查点以来用掉的块数，含回绕时跳过的部分 */
+static uint32_t j_seq;					/* 下一事务的序号 */
+
+static int* tx_tags;					/* 当前事务的tag，见struct newfs_jdesc */
+static int tx_cnt;
+static int tx_cap;
+static int* tx_frees;					/* 当前事务释放的data块，提交后才归还位图 */
+static int tx_fcnt;
+static int tx_fcap;
+static int j_pending;					/* 有待提交的改动 */
+static int j_handles;					/* 进行中的元数据操作数 */
+static int j_reserved;					/* 进行中的操作预留的记录块数之和 */
+static int j_committing;				/* 提交进行中，新操作须等待 */
+static pthread_mutex_t j_lock = PTHREAD_MUTEX_INITIALIZER;	/* 保护以上各项 */
+static pthread_cond_t j_cond = PTHREAD_COND_INITIALIZER;	/* 操作数归零、提交结束 */
+static pthread_cond_t j_kick = PTHREAD_COND_INITIALIZER;	/* 唤醒提交线程 */
+static __thread int j_credits;			/* 本线程进行中的操作预留的记录块数 */
+
+static int j_stop;
+static int j_running;
+static pthread_t j_thread;
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+static uint32_t fnv(uint32_t h, const uint8_t* p, int len)
+{
+	while (len-- > 0)
+	{
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// 事务占用的描述块数
+static int desc_blks(int cnt)
+{
+	int bytes = sizeof(struct newfs_jdesc) + cnt * sizeof(int);
+	return CEIL(bytes, super.dev_io_sz);
+}
+
+// 事务最大占用：描述块+映像+提交块
+static int tx_max_blks(void)
+{
+	return desc_blks(JOURNAL_TX_MAX) + JOURNAL_TX_MAX + 1;
+}
+
+// 当前事务已用的记录块数，含提交时才写入的位图段。须持有j_lock
+static int tx_used(void)
+{
+	return tx_cnt + newfs_bitmap_dirty_cnt(&super.inode_bm) + newfs_bitmap_dirty_cnt(&super.data_bm);
+}
+
+static void jsuper_write(int tail, uint32_t seq)
+{
+	uint8_t* blk = (uint8_t*)calloc(1, super.dev_io_sz);
+	struct newfs_jsuper* js = (struct newfs_jsuper*)blk;
+	struct newfs_iovec vec = { j_start, blk };
+
+	js->magic = JSUPER_MAGIC;
+	js->seq = seq;
+	js->tail = tail;
+	newfs_io_submit(&vec, 1, NEWFS_IO_WRITE);
+	free(blk);
+}
+
+static void jblk_read(int pos, int cnt, uint8_t* buf)
+{
+	struct newfs_iovec* vec = (struct newfs_iovec*)malloc(cnt * sizeof(struct newfs_iovec));
+	for (int i = 0; i < cnt; ++i)
+	{
+		vec[i].blkno = j_start + pos + i;
+		vec[i].buf = buf + i * super.dev_io_sz;
+	}
+	newfs_io_submit(vec, cnt, NEWFS_IO_READ);
+	free(vec);
+}
+
+// 检查点：已提交事务的块全部写回原位后清空日志。须在提交中（没有被钉住的块）
+static void checkpoint(void)
+{
+	newfs_cache_sync();
+	jsuper_write(j_head, j_seq);
+	j_used = 0;
+}
+
+// 须持有j_lock
+static void tx_add(int tag)
+{
+	if (tx_cnt == tx_cap)
+	{
+		tx_cap = tx_cap ? tx_cap * 2 : JOURNAL_TX_MAX;
+		tx_tags = (int*)realloc(tx_tags, tx_cap * sizeof(int));
+	}
+	tx_tags[tx_cnt++] = tag;
+	// 第一个改动，唤醒提交线程开始计时
+	if (!j_pending)
+	{
+		j_pending = 1;
+		pthread_cond_signal(&j_kick);
+	}
+}
+
+// 事务已落盘，归还其释放的data块；位图的改动随下一个事务提交，故每次至多改动
+// JOURNAL_FREE_SEGS个段，其余留到下次提交。须在提交中，返回仍未归还的块数
+static int tx_release(void)
+{
+	int i = 0;
+	if (tx_fcnt == 0)
+		return 0;
+	while (i < tx_fcnt && newfs_bitmap_dirty_cnt(&super.data_bm) < JOURNAL_FREE_SEGS)
+		newfs_bitmap_free(&super.data_bm, tx_frees[i++]);
+	memmove(tx_frees, tx_frees + i, (tx_fcnt - i) * sizeof(int));
+	tx_fcnt -= i;
+	return tx_fcnt;
+}
+
+// 把当前事务写入日志：描述块、映像、提交块拼成一段，一次顺序写出
+static void tx_write(void)
+{
+	int io_sz = super.dev_io_sz;
+	int dblks = desc_blks(tx_cnt);
+	int imgs = 0;
+	for (int i = 0; i < tx_cnt; ++i)
+		imgs += tx_tags[i] >= 0;
+	int need = dblks + imgs + 1;
+
+	// 操作按实际块数预留，事务不超过JOURNAL_TX_MAX；每次提交后日志区至少留有两个最大事务，总放得下
+	// 放不下则回绕到日志区开头，留一个回绕标记让重放者跟上
+	if (j_head + need > j_blks)
+	{
+		if (j_head < j_blks)
+		{
+			uint8_t* blk = (uint8_t*)calloc(1, io_sz);
+			struct newfs_jdesc* wrap = (struct newfs_jdesc*)blk;
+			struct newfs_iovec vec = { j_start + j_head, blk };
+			wrap->magic = JWRAP_MAGIC;
+			wrap->seq = j_seq;
+			newfs_io_submit(&vec, 1, NEWFS_IO_WRITE);
+			free(blk);
+		}
+		j_used += j_blks - j_head;
+		j_head = 1;
+	}
+
+	uint8_t* buf = (uint8_t*)calloc(need, io_sz);
+	struct newfs_jdesc* desc = (struct newfs_jdesc*)buf;
+	struct newfs_jcommit* commit = (struct newfs_jcommit*)(buf + (need - 1) * io_sz);
+	struct newfs_iovec* vec = (struct newfs_iovec*)malloc(need * sizeof(struct newfs_iovec));
+
+	desc->magic = JDESC_MAGIC;
+	desc->seq = j_seq;
+	desc->cnt = tx_cnt;
+	memcpy(desc->tags, tx_tags, tx_cnt * sizeof(int));
+	uint8_t* img = buf + dblks * io_sz;
+	for (int i = 0; i < tx_cnt; ++i)
+	{
+		if (tx_tags[i] < 0)
+			continue;
+		newfs_cache_read(tx_tags[i], 0, io_sz, img);
+		img += io_sz;
+	}
+	commit->magic = JCOMMIT_MAGIC;
+	commit->seq = j_seq;
+	commit->csum = fnv(2166136261u, buf, (need - 1) * io_sz);
+
+	for (int i = 0; i < need; ++i)
+	{
+		vec[i].blkno = j_start + j_head + i;
+		vec[i].buf = buf + i * io_sz;
+	}
+	newfs_io_submit(vec, need, NEWFS_IO_WRITE);
+	free(vec);
+	free(buf);
+
+	for (int i = 0; i < tx_cnt; ++i)
+		if (tx_tags[i] >= 0)
+			newfs_cache_unpin(tx_tags[i]);
+	j_head += need;
+	j_used += need;
+	++j_seq;
+}
+
+/**
+ * 读出pos处的事务并校验，成功时返回其占用块数，buf指向描述块（由调用者释放）；
+ * 遇到回绕标记时返回0并把pos移到开头；不是序号为seq的完整事务返回-1
+ */
+static int tx_read(int* pos, uint32_t seq, uint8_t** out)
+{
+	int io_sz = super.dev_io_sz;
+	uint8_t* buf = (uint8_t*)malloc(io_sz);
+	struct newfs_jdesc* desc = (struct newfs_jdesc*)buf;
+
+	if (*pos >= j_blks)
+		*pos = 1;
+	jblk_read(*pos, 1, buf);
+	if (desc->magic == JWRAP_MAGIC && desc->seq == seq && *pos != 1)
+	{
+		free(buf);
+		*pos = 1;
+		return 0;
+	}
+	if (desc->magic != JDESC_MAGIC || desc->seq != seq || desc->cnt < 0 || desc->cnt > j_blks * (io_sz / (int)sizeof(int)))
+		goto bad;
+	int dblks = desc_blks(desc->cnt);
+	if (*pos + dblks > j_blks)
+		goto bad;
+	buf = (uint8_t*)realloc(buf, dblks * io_sz);
+	desc = (struct newfs_jdesc*)buf;
+	jblk_read(*pos + 1, dblks - 1, buf + io_sz);
+
+	int imgs = 0;
+	for (int i = 0; i < desc->cnt; ++i)
+		imgs += desc->tags[i] >= 0;
+	int need = dblks + imgs + 1;
+	if (*pos + need > j_blks)
+		goto bad;
+	buf = (uint8_t*)realloc(buf, need * io_sz);
+	jblk_read(*pos + dblks, need - dblks, buf + dblks * io_sz);
+
+	struct newfs_jcommit* commit = (struct newfs_jcommit*)(buf + (need - 1) * io_sz);
+	if (commit->magic != JCOMMIT_MAGIC || commit->seq != seq
+		|| commit->csum != fnv(2166136261u, buf, (need - 1) * io_sz))
+		goto bad;
+	*out = buf;
+	return need;
+bad:
+	free(buf);
+	return -1;
+}
+
+// 提交线程：事务记入第一个块后再等JOURNAL_COMMIT_MS，期间的并发操作一起提交；事务将满时被提前唤醒
+static void* j_worker(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&j_lock);
+	while (!j_stop)
+	{
+		if (!j_pending)
+		{
+			pthread_cond_wait(&j_kick, &j_lock);
+			continue;
+		}
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&j_kick, &j_lock, &ts);
+		if (j_stop)
+			break;
+		pthread_mutex_unlock(&j_lock);
+		newfs_journal_commit();
+		pthread_mutex_lock(&j_lock);
+	}
+	pthread_mutex_unlock(&j_lock);
+	return NULL;
+}
+
+/******************************************************************************
+* SECTION: 日志接口
+*******************************************************************************/
+/**
+ * @brief 挂载时装入日志：重放日志中已提交的事务，写回原位后清空日志。
+ * 须在读位图、inode之前调用，super中的布局信息须已确定
+ *
+ * @return int 重放的事务数
+ */
+int newfs_journal_load(void)
+{
+	int io_sz = super.dev_io_sz;
+	int replayed = 0;
+
+	j_enabled = super.journal_blks > 0;
+	j_pending = 0;
+	j_reserved = 0;
+	tx_cnt = 0;
+	tx_fcnt = 0;
+	if (!j_enabled)
+		return 0;
+	j_start = super.journal_offset / io_sz;
+	j_blks = super.journal_blks;
+	j_head = 1;
+	j_seq = 1;
+	j_used = 0;
+
+	uint8_t* blk = (uint8_t*)malloc(io_sz);
+	struct newfs_jsuper* js = (struct newfs_jsuper*)blk;
+	jblk_read(0, 1, blk);
+	if (js->magic == JSUPER_MAGIC && js->tail >= 1 && js->tail < j_blks)
+	{
+		j_head = js->tail;
+		j_seq = js->seq;
+	}
+	free(blk);
+
+	// 第一遍收集撤销记录：被撤销的块不重放撤销之前（含同一事务）的映像
+	int* revoked = NULL;
+	uint32_t* revoked_seq = NULL;
+	int rcnt = 0;
+	int pos = j_head;
+	uint32_t seq = j_seq;
+	uint8_t* buf;
+	int n;
+	while ((n = tx_read(&pos, seq, &buf)) >= 0)
+	{
+		if (n == 0)
+			continue;
+		struct newfs_jdesc* desc = (struct newfs_jdesc*)buf;
+		for (int i = 0; i < desc->cnt; ++i)
+		{
+			if (desc->tags[i] >= 0)
+				continue;
+			revoked = (int*)realloc(revoked, (rcnt + 1) * sizeof(int));
+			revoked_seq = (uint32_t*)realloc(revoked_seq, (rcnt + 1) * sizeof(uint32_t));
+			revoked[rcnt] = -desc->tags[i] - 1;
+			revoked_seq[rcnt] = seq;
+			++rcnt;
+		}
+		free(buf);
+		pos += n;
+		++seq;
+	}
+
+	// 第二遍按序把映像写回原位
+	pos = j_head;
+	while ((n = tx_read(&pos, j_seq, &buf)) >= 0)
+	{
+		if (n == 0)
+			continue;
+		struct newfs_jdesc* desc = (struct newfs_jdesc*)buf;
+		uint8_t* img = buf + desc_blks(desc->cnt) * io_sz;
+		for (int i = 0; i < desc->cnt; ++i)
+		{
+			int blkno = desc->tags[i];
+			if (blkno < 0)
+				continue;
+			int skip = 0;
+			for (int r = 0; r < rcnt && !skip; ++r)
+				skip = revoked[r] == blkno && revoked_seq[r] >= j_seq;
+			if (!skip)
+				newfs_cache_write(blkno, 0, io_sz, img);
+			img += io_sz;
+		}
+		free(buf);
+		pos += n;
+		++j_seq;
+		++replayed;
+	}
+	free(revoked);
+	free(revoked_seq);
+	j_head = pos >= j_blks ? 1 : pos;
+	newfs_cache_sync();
+	jsuper_write(j_head, j_seq);
+	return replayed;
+}
+
+/**
+ * @brief 启动提交线程，没有日志区时它定期写出改动过的位图段
+ *
+ * @return int 0成功，否则失败（此时只在事务将满、fsync、statfs和卸载时提交）
+ */
+int newfs_journal_start(void)
+{
+	j_stop = 0;
+	if (pthread_create(&j_thread, NULL, j_worker, NULL) != 0)
+		return -EAGAIN;
+	j_running = 1;
+	return 0;
+}
+
+/**
+ * @brief 卸载：停止提交线程，提交剩余操作并做检查点，之后日志为空
+ */
+void newfs_journal_stop(void)
+{
+	if (j_running)
+	{
+		pthread_mutex_lock(&j_lock);
+		j_stop = 1;
+		pthread_cond_signal(&j_kick);
+		pthread_mutex_unlock(&j_lock);
+		pthread_join(j_thread, NULL);
+		j_running = 0;
+	}
+	newfs_journal_commit();
+	// 归还释放的块改动了位图，再提交直到全部落盘
+	while (j_pending)
+		newfs_journal_commit();
+	if (j_enabled)
+		checkpoint();
+	free(tx_tags);
+	tx_tags = NULL;
+	tx_cap = 0;
+	free(tx_frees);
+	tx_frees = NULL;
+	tx_fcap = 0;
+}
+
+/**
+ * @brief 元数据操作开始，之后的newfs_journal_write都属于同一事务。
+ * 提交进行中或当前事务剩余空间不足时等待；须在取得inode锁之后调用，操作期间不得再等待inode锁
+ *
+ * @param credits 本操作至多记录的设备块数，含撤销记录与其改动的位图段，不超过JOURNAL_TX_MAX；
+ * 超出时调用者须把操作拆到多个事务中
+ */
+void newfs_journal_begin(int credits)
+{
+	if (!j_enabled)
+		return;
+	pthread_mutex_lock(&j_lock);
+	while (1)
+	{
+		if (j_committing)
+		{
+			pthread_cond_wait(&j_cond, &j_lock);
+			continue;
+		}
+		if (tx_used() + j_reserved + credits <= JOURNAL_TX_MAX)
+			break;
+		if (j_handles == 0)
+		{
+			pthread_mutex_unlock(&j_lock);
+			newfs_journal_commit();
+			pthread_mutex_lock(&j_lock);
+			continue;
+		}
+		pthread_cond_wait(&j_cond, &j_lock);
+	}
+	++j_handles;
+	j_reserved += credits;
+	j_credits = credits;
+	pthread_mutex_unlock(&j_lock);
+}
+
+/**
+ * @brief 元数据操作结束，不等待提交
+ */
+void newfs_journal_end(void)
+{
+	pthread_mutex_lock(&j_lock);
+	// 没有日志区时只通知提交线程稍后写出位图段
+	if (!j_enabled)
+	{
+		if (!j_pending)
+		{
+			j_pending = 1;
+			pthread_cond_signal(&j_kick);
+		}
+		pthread_mutex_unlock(&j_lock);
+		return;
+	}
+	j_reserved -= j_credits;
+	if (--j_handles == 0)
+		pthread_cond_broadcast(&j_cond);
+	if (tx_used() > JOURNAL_TX_MAX / 2)
+		pthread_cond_signal(&j_kick);
+	pthread_mutex_unlock(&j_lock);
+}
+
+/**
+ * @brief 写元数据，接口同newfs_driver_write；须在begin/end之间。
+ * 所写设备块钉在块缓存中，事务提交前不会写回原位
+ */
+void newfs_journal_write(off_t offset, int size, uint8_t* in)
+{
+	int io_sz = super.dev_io_sz;
+	int blkno = (int)(offset / io_sz);
+	int bias = (int)(offset % io_sz);
+
+	if (!j_enabled)
+	{
+		newfs_driver_write(offset, size, in);
+		return;
+	}
+	while (size > 0)
+	{
+		int len = io_sz - bias < size ? io_sz - bias : size;
+		if (newfs_cache_write_pin(blkno, bias, len, in))
+		{
+			pthread_mutex_lock(&j_lock);
+			tx_add(blkno);
+			pthread_mutex_unlock(&j_lock);
+		}
+		in += len;
+		size -= len;
+		bias = 0;
+		++blkno;
+	}
+}
+
+/**
+ * @brief 记录元数据块已释放（可能改作数据块），重放时不再用日志中该块的旧映像覆盖；须在begin/end之间
+ *
+ * @param blkno 设备块号
+ */
+void newfs_journal_revoke(int blkno)
+{
+	if (!j_enabled)
+		return;
+	pthread_mutex_lock(&j_lock);
+	tx_add(-blkno - 1);
+	pthread_mutex_unlock(&j_lock);
+}
+
+/**
+ * @brief 释放data块，事务提交后才归还分配器；须在begin/end之间。没有日志区时立即释放
+ *
+ * @param bno data区块号
+ */
+void newfs_journal_free(int bno)
+{
+	if (!j_enabled)
+	{
+		newfs_bitmap_free(&super.data_bm, bno);
+		return;
+	}
+	pthread_mutex_lock(&j_lock);
+	if (tx_fcnt == tx_fcap)
+	{
+		tx_fcap = tx_fcap ? tx_fcap * 2 : JOURNAL_TX_MAX;
+		tx_frees = (int*)realloc(tx_frees, tx_fcap * sizeof(int));
+	}
+	tx_frees[tx_fcnt++] = bno;
+	pthread_mutex_unlock(&j_lock);
+}
+
+/**
+ * @brief 当前事务释放、尚未归还的data块数，空间不足时据此决定是否先提交
+ */
+int newfs_journal_freeing(void)
+{
+	pthread_mutex_lock(&j_lock);
+	int cnt = tx_fcnt;
+	pthread_mutex_unlock(&j_lock);
+	return cnt;
+}
+
+/**
+ * @brief 提交当前事务：等进行中的操作结束，记入改动过的位图段，一次顺序写入日志；
+ * 日志区剩余空间不够下一个最大事务时做检查点。调用者不得处于begin/end之间
+ */
+void newfs_journal_commit(void)
+{
+	if (!j_enabled)
+	{
+		pthread_mutex_lock(&j_lock);
+		j_pending = 0;
+		pthread_mutex_unlock(&j_lock);
+		newfs_bitmap_flush(&super.inode_bm, newfs_group_imap_off, newfs_driver_write);
+		newfs_bitmap_flush(&super.data_bm, newfs_group_dmap_off, newfs_driver_write);
+		return;
+	}
+	pthread_mutex_lock(&j_lock);
+	while (j_committing)
+		pthread_cond_wait(&j_cond, &j_lock);
+	j_committing = 1;
+	while (j_handles > 0)
+		pthread_cond_wait(&j_cond, &j_lock);
+	pthread_mutex_unlock(&j_lock);
+
+	// 提交期间不会有新操作，以下不必持有j_lock
+	newfs_bitmap_flush(&super.inode_bm, newfs_group_imap_off, newfs_journal_write);
+	newfs_bitmap_flush(&super.data_bm, newfs_group_dmap_off, newfs_journal_write);
+	if (tx_cnt > 0)
+		tx_write();
+	int left = tx_release();
+	// 回绕最多浪费一个事务的空间，故留出两个最大事务
+	if ((j_blks - 1) - j_used < 2 * tx_max_blks())
+		checkpoint();
+
+	pthread_mutex_lock(&j_lock);
+	tx_cnt = 0;
+	j_pending = left > 0 || newfs_bitmap_dirty_cnt(&super.data_bm) > 0;
+	j_committing = 0;
+	pthread_cond_broadcast(&j_cond);
+	pthread_mutex_unlock(&j_lock);
+}
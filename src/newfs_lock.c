@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 全局变量
+*******************************************************************************/
+static pthread_rwlock_t tree_lock;					/* 目录树锁：普通操作共享持有，卸载子树/回收独占 */
+static pthread_once_t tree_once = PTHREAD_ONCE_INIT;
+
+static void** retired;								/* 待回收的内存，可能仍被共享持有者引用 */
+static int retired_cnt;
+static int retired_cap;
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+// 写者优先，避免连续的读操作使卸载/回收一直得不到执行
+static void tree_lock_init(void)
+{
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&tree_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+/******************************************************************************
+* SECTION: 目录树锁与延迟回收
+* 每个FUSE操作在整个执行期间共享持有目录树锁，期间目录项与inode不会被释放；
+* 目录、文件内容由各inode自己的读写锁保护。被替换下来的目录项数组、路径缓存项
+* 可能仍被其他操作引用，先挂入待回收表，到下一次独占持有目录树锁时（此时没有任何
+* 操作在进行，相当于RCU的宽限期结束）统一释放
+*******************************************************************************/
+/**
+ * @brief 持有目录树锁
+ *
+ * @param excl 非0为独占，否则为共享；共享持有者不得再次请求
+ */
+void newfs_tree_lock(int excl)
+{
+	pthread_once(&tree_once, tree_lock_init);
+	if (excl)
+		pthread_rwlock_wrlock(&tree_lock);
+	else
+		pthread_rwlock_rdlock(&tree_lock);
+}
+
+/**
+ * @brief 释放目录树锁
+ */
+void newfs_tree_unlock(void)
+{
+	pthread_rwlock_unlock(&tree_lock);
+}
+
+/**
+ * @brief 延迟释放p，共享持有目录树锁时调用
+ */
+void newfs_retire(void* p)
+{
+	pthread_mutex_lock(&retire_lock);
+	if (retired_cnt == retired_cap)
+	{
+		retired_cap = retired_cap ? retired_cap * 2 : 64;
+		retired = (void**)realloc(retired, retired_cap * sizeof(void*));
+	}
+	retired[retired_cnt] = p;
+	__atomic_store_n(&retired_cnt, retired_cnt + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&retire_lock);
+}
+
+/**
+ * @brief 待回收的内存块数
+ */
+int newfs_retire_pending(void)
+{
+	return __atomic_load_n(&retired_cnt, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 释放全部待回收内存，须独占持有目录树锁（或已无其他线程）
+ */
+void newfs_reclaim(void)
+{
+	pthread_mutex_lock(&retire_lock);
+	for (int i = 0; i < retired_cnt; ++i)
+		free(retired[i]);
+	free(retired);
+	retired = NULL;
+	retired_cap = 0;
+	__atomic_store_n(&retired_cnt, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&retire_lock);
+}
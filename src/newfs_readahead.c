@@ -0,0 +1,168 @@
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 全局变量
+*******************************************************************************/
+extern struct newfs_super super;
+
+static struct newfs_ra_req ra_queue[RA_QUEUE_SZ];	/* 待预读的设备块段，环形队列 */
+static int ra_head, ra_tail;						/* 出队、入队位置 */
+static int ra_stop;									/* 通知预读线程退出 */
+static int ra_running;
+static pthread_t ra_thread;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+// 预读线程：逐个取出请求装入块缓存
+static void* ra_worker(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&ra_lock);
+	while (1)
+	{
+		while (ra_head == ra_tail && !ra_stop)
+			pthread_cond_wait(&ra_cond, &ra_lock);
+		if (ra_stop)
+			break;
+		struct newfs_ra_req req = ra_queue[ra_head];
+		ra_head = (ra_head + 1) % RA_QUEUE_SZ;
+
+		pthread_mutex_unlock(&ra_lock);
+		newfs_cache_readahead(req.blkno, req.cnt);
+		pthread_mutex_lock(&ra_lock);
+	}
+	pthread_mutex_unlock(&ra_lock);
+	return NULL;
+}
+
+// 请求入队；队列满时直接丢弃，预读只是提示
+static void ra_enqueue(int blkno, int cnt)
+{
+	pthread_mutex_lock(&ra_lock);
+	if ((ra_tail + 1) % RA_QUEUE_SZ != ra_head)
+	{
+		ra_queue[ra_tail].blkno = blkno;
+		ra_queue[ra_tail].cnt = cnt;
+		ra_tail = (ra_tail + 1) % RA_QUEUE_SZ;
+		pthread_cond_signal(&ra_cond);
+	}
+	pthread_mutex_unlock(&ra_lock);
+}
+
+// 剩余的已预读部分不足半个窗口时，窗口加倍并将其后一个窗口映射为设备块段入队
+static void ra_submit(struct newfs_inode* inode, struct newfs_ra* ra)
+{
+	int blk_sz = 2 * super.dev_io_sz;
+	int blks_per = blk_sz / super.dev_io_sz;
+	int cur = CEIL(ra->next_off, blk_sz);
+	int eof = CEIL(inode->size, blk_sz);
+
+	if (ra->ra_end < cur)
+		ra->ra_end = cur;
+	if (ra->ra_end - cur >= ra->window / 2 || ra->ra_end >= eof)
+		return;
+
+	if (ra->window < RA_MAX_BLKS)
+		ra->window *= 2;
+	int start = ra->ra_end;
+	int end = cur + ra->window < eof ? cur + ra->window : eof;
+	for (int lblk = start; lblk < end; )
+	{
+		int run;
+		int pblk = newfs_bmap(inode, lblk, &run);
+		if (run > end - lblk)
+			run = end - lblk;
+		lblk += run;
+		// 空洞读出全0，无需预读；块组边界处磁盘上不连续，分段提交
+		while (pblk && run > 0)
+		{
+			int n = newfs_blk_contig(&super, pblk);
+			if (n > run)
+				n = run;
+			ra_enqueue(newfs_blk_off(&super, pblk) / super.dev_io_sz, n * blks_per);
+			pblk += n;
+			run -= n;
+		}
+	}
+	ra->ra_end = end;
+}
+
+/******************************************************************************
+* SECTION: 预读接口
+*******************************************************************************/
+/**
+ * @brief 启动预读线程，块缓存初始化后调用
+ *
+ * @return int 0成功，否则失败（此时不预读，读操作不受影响）
+ */
+int newfs_readahead_start(void)
+{
+	ra_head = ra_tail = 0;
+	ra_stop = 0;
+	if (pthread_create(&ra_thread, NULL, ra_worker, NULL) != 0)
+		return -EAGAIN;
+	ra_running = 1;
+	return 0;
+}
+
+/**
+ * @brief 丢弃未完成的请求并等待预读线程退出，须在块缓存销毁前调用
+ */
+void newfs_readahead_stop(void)
+{
+	if (!ra_running)
+		return;
+	pthread_mutex_lock(&ra_lock);
+	ra_stop = 1;
+	pthread_cond_signal(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+	pthread_join(ra_thread, NULL);
+	ra_running = 0;
+}
+
+/**
+ * @brief 新建打开文件的预读状态
+ */
+struct newfs_ra* newfs_ra_new(void)
+{
+	struct newfs_ra* ra = (struct newfs_ra*)calloc(1, sizeof(struct newfs_ra));
+	ra->next_off = 0;		/* 从头开始读视为顺序读 */
+	ra->window = RA_MIN_BLKS;
+	pthread_mutex_init(&ra->lock, NULL);
+	return ra;
+}
+
+/**
+ * @brief 一次读完成后调用：识别顺序读，窗口逐次翻倍直到RA_MAX_BLKS；
+ * 剩余的已预读部分不足半个窗口时，将其后一个窗口映射为设备块段交给预读线程。
+ * 随机读时窗口回到初始大小且不发预读
+ *
+ * @param inode 文件inode
+ * @param ra 打开文件的预读状态
+ * @param offset 本次读的起始偏移
+ * @param size 本次读出的字节数
+ */
+void newfs_readahead(struct newfs_inode* inode, struct newfs_ra* ra, off_t offset, size_t size)
+{
+	// 预读只是提示，状态正被其他读更新时直接跳过
+	if (pthread_mutex_trylock(&ra->lock) != 0)
+		return;
+
+	int sequential = offset == ra->next_off;
+	ra->next_off = offset + size;
+	if (ra_running && size > 0)
+	{
+		if (sequential)
+			ra_submit(inode, ra);
+		else
+		{
+			ra->window = RA_MIN_BLKS;
+			ra->ra_end = 0;
+		}
+	}
+	pthread_mutex_unlock(&ra->lock);
+}
+
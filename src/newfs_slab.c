@@ -0,0 +1,109 @@
+#include "newfs.h"
+#include <stdalign.h>
+
+/******************************************************************************
+* SECTION: 定长对象池（slab），每次向malloc申请一整块容纳多个对象，释放的对象挂入
+* 空闲链表供下次分配复用，池销毁时才归还内存
+*******************************************************************************/
+#define SLAB_ALIGN	alignof(max_align_t)
+
+// slab首部，其后紧跟per_slab个对象
+struct slab {
+	struct slab* next;
+};
+
+#define SLAB_HDR_SZ	(CEIL(sizeof(struct slab), SLAB_ALIGN) * SLAB_ALIGN)
+
+/**
+ * @brief 初始化对象池
+ *
+ * @param name 池名，统计输出用
+ * @param obj_sz 对象大小，按最大对齐取整，不小于一个指针
+ * @param per_slab 每个slab容纳的对象数
+ */
+void newfs_pool_init(struct newfs_pool* pool, const char* name, size_t obj_sz, int per_slab)
+{
+	memset(pool, 0, sizeof(struct newfs_pool));
+	pool->name = name;
+	pool->obj_sz = CEIL(obj_sz, SLAB_ALIGN) * SLAB_ALIGN;
+	pool->per_slab = per_slab;
+	pthread_mutex_init(&pool->lock, NULL);
+}
+
+/**
+ * @brief 分配一个清零的对象，空闲链表为空时新申请一个slab
+ *
+ * @return void* 对象地址
+ */
+void* newfs_pool_alloc(struct newfs_pool* pool)
+{
+	void* obj;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->free_list == NULL)
+	{
+		struct slab* s = (struct slab*)malloc(SLAB_HDR_SZ + pool->per_slab * pool->obj_sz);
+		s->next = pool->slabs;
+		pool->slabs = s;
+		++pool->slab_cnt;
+		// 倒序挂入，使分配按地址递增
+		for (int i = pool->per_slab - 1; i >= 0; --i)
+		{
+			void** o = (void**)((uint8_t*)s + SLAB_HDR_SZ + i * pool->obj_sz);
+			*o = pool->free_list;
+			pool->free_list = o;
+		}
+	}
+	obj = pool->free_list;
+	pool->free_list = *(void**)obj;
+	++pool->allocs;
+	if (++pool->in_use > pool->peak)
+		pool->peak = pool->in_use;
+	pthread_mutex_unlock(&pool->lock);
+
+	memset(obj, 0, pool->obj_sz);
+	return obj;
+}
+
+/**
+ * @brief 归还对象到空闲链表
+ */
+void newfs_pool_free(struct newfs_pool* pool, void* obj)
+{
+	if (obj == NULL)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	*(void**)obj = pool->free_list;
+	pool->free_list = obj;
+	++pool->frees;
+	--pool->in_use;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief 输出池的统计：slab数、在用与峰值对象数、累计分配/释放次数
+ */
+void newfs_pool_stat(struct newfs_pool* pool, FILE* out)
+{
+	pthread_mutex_lock(&pool->lock);
+	fprintf(out, "pool %-8s obj %4zu B  slabs %5d (%ld KiB)  in use %7d  peak %7d  allocs %9ld  frees %9ld\n",
+			pool->name, pool->obj_sz, pool->slab_cnt,
+			(long)pool->slab_cnt * (SLAB_HDR_SZ + pool->per_slab * pool->obj_sz) / 1024,
+			pool->in_use, pool->peak, pool->allocs, pool->frees);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief 释放全部slab，池中对象此后不得再使用
+ */
+void newfs_pool_destroy(struct newfs_pool* pool)
+{
+	while (pool->slabs)
+	{
+		struct slab* s = pool->slabs;
+		pool->slabs = s->next;
+		free(s);
+	}
+	pool->free_list = NULL;
+	pthread_mutex_destroy(&pool->lock);
+}
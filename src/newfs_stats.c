@@ -0,0 +1,251 @@
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 操作统计：每个FUSE操作的调用数、时延直方图、归属于该操作的设备IO与缓存命中。
+* 计数按线程分开，各线程只写自己的计数块、不加锁；汇总时读取全部线程的计数块。
+* 后台线程（预读、延迟分配、日志提交）以及操作之外引起的IO记在other下
+*******************************************************************************/
+#define STAT_ADD(field, n)	__atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define STAT_GET(field)		__atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+// 一个线程的计数块，注册后不释放，线程退出后其计数仍计入汇总
+struct stats_thread {
+	struct newfs_op_stat ops[NEWFS_OP_NUM];
+	struct stats_thread* next;
+};
+
+static const char* op_names[NEWFS_OP_NUM] = {
+	[NEWFS_OP_OTHER]	= "other",
+	[NEWFS_OP_GETATTR]	= "getattr",
+	[NEWFS_OP_MKDIR]	= "mkdir",
+	[NEWFS_OP_MKNOD]	= "mknod",
+	[NEWFS_OP_READDIR]	= "readdir",
+	[NEWFS_OP_OPEN]		= "open",
+	[NEWFS_OP_RELEASE]	= "release",
+	[NEWFS_OP_READ]		= "read",
+	[NEWFS_OP_WRITE]	= "write",
+	[NEWFS_OP_TRUNCATE]	= "truncate",
+	[NEWFS_OP_UTIMENS]	= "utimens",
+	[NEWFS_OP_FSYNC]	= "fsync",
+	[NEWFS_OP_DESTROY]	= "destroy",
+};
+
+static struct stats_thread* threads;					/* 已注册的计数块 */
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct stats_thread* self;				/* 本线程的计数块 */
+static __thread int cur_op;								/* 本线程正在执行的操作，IO与缓存命中记在其下 */
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+static struct newfs_op_stat* cur_stat(void)
+{
+	if (self == NULL)
+	{
+		self = (struct stats_thread*)calloc(1, sizeof(struct stats_thread));
+		pthread_mutex_lock(&threads_lock);
+		self->next = threads;
+		threads = self;
+		pthread_mutex_unlock(&threads_lock);
+	}
+	return self->ops + cur_op;
+}
+
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// 时延所在的桶：第i桶为[2^i, 2^(i+1))纳秒，末桶含更长的时延
+static int hist_bucket(long ns)
+{
+	int b = ns > 0 ? 63 - __builtin_clzl(ns) : 0;
+	return b < STATS_HIST_NUM ? b : STATS_HIST_NUM - 1;
+}
+
+// 累加全部线程中op的计数
+static void op_sum(int op, struct newfs_op_stat* sum)
+{
+	memset(sum, 0, sizeof(struct newfs_op_stat));
+	pthread_mutex_lock(&threads_lock);
+	for (struct stats_thread* t = threads; t; t = t->next)
+	{
+		struct newfs_op_stat* s = t->ops + op;
+		sum->calls += STAT_GET(s->calls);
+		sum->ns += STAT_GET(s->ns);
+		sum->max_ns = STAT_GET(s->max_ns) > sum->max_ns ? STAT_GET(s->max_ns) : sum->max_ns;
+		for (int i = 0; i < STATS_HIST_NUM; ++i)
+			sum->hist[i] += STAT_GET(s->hist[i]);
+		sum->dev_read += STAT_GET(s->dev_read);
+		sum->dev_write += STAT_GET(s->dev_write);
+		sum->dev_seek += STAT_GET(s->dev_seek);
+		sum->cache_hit += STAT_GET(s->cache_hit);
+		sum->cache_miss += STAT_GET(s->cache_miss);
+		sum->dcache_hit += STAT_GET(s->dcache_hit);
+		sum->dcache_miss += STAT_GET(s->dcache_miss);
+	}
+	pthread_mutex_unlock(&threads_lock);
+}
+
+// 由直方图估计分位数，取所在桶的上界（微秒），不超过最大时延
+static double hist_quantile(const struct newfs_op_stat* s, double q)
+{
+	long need = (long)(q * s->calls + 0.5);
+	long acc = 0;
+
+	if (need < 1)
+		need = 1;
+	for (int i = 0; i < STATS_HIST_NUM; ++i)
+	{
+		acc += s->hist[i];
+		if (acc >= need)
+			return (double)((2L << i) < s->max_ns ? (2L << i) : s->max_ns) / 1000;
+	}
+	return (double)s->max_ns / 1000;
+}
+
+static double rate(long hit, long miss)
+{
+	return hit + miss ? 100.0 * hit / (hit + miss) : 0;
+}
+
+/******************************************************************************
+* SECTION: 计数接口
+*******************************************************************************/
+/**
+ * @brief 清零全部计数，挂载时调用
+ */
+void newfs_stats_reset(void)
+{
+	pthread_mutex_lock(&threads_lock);
+	for (struct stats_thread* t = threads; t; t = t->next)
+		memset(t->ops, 0, sizeof(t->ops));
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/**
+ * @brief 操作开始，此后本线程引起的IO与缓存命中记在op下
+ *
+ * @return long 开始时刻，传给newfs_stats_end
+ */
+long newfs_stats_begin(int op)
+{
+	cur_op = op;
+	return now_ns();
+}
+
+/**
+ * @brief 操作结束，记录调用数与时延
+ *
+ * @param start newfs_stats_begin的返回值
+ */
+void newfs_stats_end(int op, long start)
+{
+	long ns = now_ns() - start;
+	struct newfs_op_stat* s;
+
+	cur_op = op;
+	s = cur_stat();
+	STAT_ADD(s->calls, 1);
+	STAT_ADD(s->ns, ns);
+	STAT_ADD(s->hist[hist_bucket(ns)], 1);
+	if (ns > s->max_ns)
+		__atomic_store_n(&s->max_ns, ns, __ATOMIC_RELAXED);
+	cur_op = NEWFS_OP_OTHER;
+}
+
+/**
+ * @brief 记录本线程提交的设备IO
+ */
+void newfs_stats_io(int reads, int writes, int seeks)
+{
+	struct newfs_op_stat* s = cur_stat();
+	STAT_ADD(s->dev_read, reads);
+	STAT_ADD(s->dev_write, writes);
+	STAT_ADD(s->dev_seek, seeks);
+}
+
+/**
+ * @brief 记录一次块缓存查找是否命中
+ */
+void newfs_stats_cache(int hit)
+{
+	struct newfs_op_stat* s = cur_stat();
+	if (hit)
+		STAT_ADD(s->cache_hit, 1);
+	else
+		STAT_ADD(s->cache_miss, 1);
+}
+
+/**
+ * @brief 记录一次路径缓存查找是否命中
+ */
+void newfs_stats_dcache(int hit)
+{
+	struct newfs_op_stat* s = cur_stat();
+	if (hit)
+		STAT_ADD(s->dcache_hit, 1);
+	else
+		STAT_ADD(s->dcache_miss, 1);
+}
+
+/******************************************************************************
+* SECTION: 输出
+*******************************************************************************/
+/**
+ * @brief 汇总全部线程的计数，生成文本报告：每个有调用或有IO的操作一行概要，
+ * 一行非空的时延直方图桶（按桶上界标注）
+ *
+ * @param out 返回报告，调用者free
+ * @return int 报告长度
+ */
+int newfs_stats_render(char** out)
+{
+	struct newfs_op_stat s;
+	size_t len;
+	FILE* f = open_memstream(out, &len);
+
+	fprintf(f, "%-8s %8s %10s %10s %10s %10s %9s %9s %8s %7s %7s\n", "op", "calls", "avg(us)", "p50(us)",
+			"p99(us)", "max(us)", "dev_read", "dev_write", "seeks", "cache%", "dcache%");
+	for (int op = 0; op < NEWFS_OP_NUM; ++op)
+	{
+		op_sum(op, &s);
+		if (s.calls == 0 && s.dev_read + s.dev_write + s.cache_hit + s.cache_miss == 0)
+			continue;
+		fprintf(f, "%-8s %8ld %10.1f %10.1f %10.1f %10.1f %9ld %9ld %8ld %7.1f %7.1f\n", op_names[op], s.calls,
+				s.calls ? (double)s.ns / s.calls / 1000 : 0, s.calls ? hist_quantile(&s, 0.5) : 0,
+				s.calls ? hist_quantile(&s, 0.99) : 0, (double)s.max_ns / 1000, s.dev_read, s.dev_write,
+				s.dev_seek, rate(s.cache_hit, s.cache_miss), rate(s.dcache_hit, s.dcache_miss));
+		if (s.calls == 0)
+			continue;
+		fprintf(f, "  hist");
+		for (int i = 0; i < STATS_HIST_NUM; ++i)
+		{
+			long upper = 2L << i;
+			if (s.hist[i] == 0)
+				continue;
+			if (upper < 1000)
+				fprintf(f, " <%ldns:%ld", upper, s.hist[i]);
+			else if (upper < 1000000)
+				fprintf(f, " <%ldus:%ld", upper / 1000, s.hist[i]);
+			else
+				fprintf(f, " <%ldms:%ld", upper / 1000000, s.hist[i]);
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+	return (int)len;
+}
+
+/**
+ * @brief 输出报告，卸载时调用
+ */
+void newfs_stats_dump(FILE* out)
+{
+	char* text;
+	newfs_stats_render(&text);
+	fputs(text, out);
+	free(text);
+}
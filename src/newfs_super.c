@@ -0,0 +1,129 @@
+#include "newfs.h"
+
+/******************************************************************************
+* SECTION: 全局变量，FUSE守护进程与离线工具（fsck.newfs）共用
+*******************************************************************************/
+struct custom_options newfs_options;			 /* 全局选项 */
+struct newfs_super super;
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+// 早期版本把内存中的超级块原样写盘，文件系统标识位于第12字节
+#define LEGACY_MAGIC_OFF 12
+
+// 直接从设备读超级块，填入布局参数；magic不符时只填magic，即非本文件系统。
+// 返回0，-EPROTO为早期版本的超级块，-EINVAL为格式化时的设备IO单位与当前设备不符
+static int read_super(void)
+{
+	int io_sz = super.dev_io_sz;
+	uint8_t* buf = (uint8_t*)malloc(io_sz);
+	struct newfs_iovec vec = { 0, buf };
+	struct newfs_dsuper* d = (struct newfs_dsuper*)buf;
+	uint32_t legacy;
+	int ret = 0;
+
+	newfs_io_submit(&vec, 1, NEWFS_IO_READ);
+	memcpy(&legacy, buf + LEGACY_MAGIC_OFF, sizeof(legacy));
+	super.magic = d->magic;
+	if (d->magic != NEWFS_MAGIC)
+		ret = legacy == NEWFS_MAGIC ? -EPROTO : 0;
+	else if (d->io_sz != io_sz)
+		ret = -EINVAL;
+	else
+		newfs_super_deserialize(&super, d);
+	free(buf);
+	return ret;
+}
+
+/******************************************************************************
+* SECTION: 超级块接口
+*******************************************************************************/
+/**
+ * @brief 打开设备并读入超级块，校验格式版本与布局；失败时输出原因并关闭设备。
+ * 之后可初始化块缓存、重放日志、读位图
+ *
+ * @param prog 出错信息的前缀
+ * @param device ddriver设备路径
+ * @param format_bpi 大于0时，非本文件系统的设备以此每inode字节数格式化；为0时视为错误
+ * @return int 0成功，否则为负的错误码
+ */
+int newfs_super_open(const char* prog, const char* device, int format_bpi)
+{
+	struct newfs_super sb;
+	int fd, io_sz, ret;
+	off_t disk_sz, need;
+
+	memset(&super, 0, sizeof(struct newfs_super));
+	fd = ddriver_open((char*)device);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: cannot open device %s: %s\n", prog, device, strerror(errno));
+		return -ENODEV;
+	}
+	// 查询失败时拒绝挂载，不按截断的大小只用设备的一部分
+	disk_sz = newfs_dev_size(fd);
+	if (disk_sz < 0)
+	{
+		fprintf(stderr, "%s: cannot get size of %s: %s\n", prog, device, strerror((int)-disk_sz));
+		goto err;
+	}
+	ddriver_ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &io_sz);
+	super.fd = fd;
+	super.dev_disk_sz = disk_sz;
+	super.dev_io_sz = io_sz;
+	newfs_io_reset();
+
+	// 非本文件系统标识时按设备大小格式化。格式化直接写设备，故超级块不经块缓存读
+	switch (read_super())
+	{
+	case -EPROTO:
+		fprintf(stderr, "%s: on-disk format is too old, reformat with mkfs.newfs\n", prog);
+		goto err;
+	case -EINVAL:
+		fprintf(stderr, "%s: %s was formatted with a different io unit\n", prog, device);
+		goto err;
+	}
+	if (super.magic != NEWFS_MAGIC)
+	{
+		if (format_bpi <= 0)
+		{
+			fprintf(stderr, "%s: %s does not contain a newfs file system\n", prog, device);
+			goto err;
+		}
+		if ((ret = newfs_format(fd, disk_sz, io_sz, format_bpi, &sb)) < 0)
+		{
+			fprintf(stderr, "%s: device of %lld bytes is too %s to format\n", prog, (long long)disk_sz,
+					ret == -EFBIG ? "large" : "small");
+			goto err;
+		}
+		newfs_io_reset();
+		read_super();
+	}
+	// 更早的格式：inode表为内存结构原样写入、超级块中的偏移为32位，无法可靠解读
+	if ((super.features & NEWFS_FEAT_REQUIRED) != NEWFS_FEAT_REQUIRED)
+	{
+		fprintf(stderr, "%s: on-disk format is too old, reformat with mkfs.newfs\n", prog);
+		goto err;
+	}
+	// 超级块记录的布局须放得进设备，例如镜像被截短时拒绝挂载
+	need = newfs_blk_off(&super, super.max_data - 1) + 2 * io_sz;
+	if (need > disk_sz)
+	{
+		fprintf(stderr, "%s: layout needs %lld bytes, device has %lld\n", prog, (long long)need,
+				(long long)disk_sz);
+		goto err;
+	}
+	return 0;
+err:
+	ddriver_close(fd);
+	return -EINVAL;
+}
+
+/**
+ * @brief 关闭设备，块缓存须已写回
+ */
+void newfs_super_close(void)
+{
+	ddriver_close(super.fd);
+}
@@ -0,0 +1,118 @@
+#!/bin/bash
+# 基准套件：在文件模拟设备上挂载newfs，运行参数化负载，结果以JSON写入OUT
+# 用法: ./bench.sh [N] [OUT]   默认 N=2000 OUT=bench.json
+# 负载：扁平/深层目录下N个文件的create/stat/readdir，多种块大小的顺序/随机读写，
+# 重挂载耗时与命名空间规模的关系，多线程混合负载。每项一行JSON，含ops/s、p50/p99时延，
+# 以及由/.newfs_stats前后差得到的设备IO次数
+# 环境变量: BUILD_DIR(默认../build) DEV_SIZE(默认512M) SIZE(读写文件大小，默认16M)
+#           THREADS(混合负载线程数，默认4) DEPTH(深层目录层数，默认8)
+ORIGIN_WORK_DIR=$PWD
+OUT=$(realpath -m ${2:-bench.json})
+
+WORK_DIR=$(cd `dirname $0`; pwd)
+cd $WORK_DIR
+
+MNTPOINT='./mnt'
+PROJECT_NAME="newfs"
+BUILD_DIR=${BUILD_DIR:-../build}
+BENCH=${BUILD_DIR}/newfs_bench
+DEVICE=/tmp/newfs_bench.img
+N=${1:-2000}
+SIZE=${SIZE:-16M}
+THREADS=${THREADS:-4}
+DEPTH=${DEPTH:-8}
+RESULTS=()
+
+export NEWFS_DDRIVER_BACKEND=file
+export NEWFS_DDRIVER_SIZE=${DEV_SIZE:-512M}
+
+function do_mount() {
+    ${BUILD_DIR}/${PROJECT_NAME} --device=${DEVICE} --entry-timeout=0 --attr-timeout=0 --cache=none \
+        -o direct_io ${MNTPOINT}
+}
+
+# 卸载并等待守护进程退出，保证元数据已写回设备
+function do_umount() {
+    fusermount -u ${MNTPOINT}
+    while pgrep -f "${PROJECT_NAME} --device=${DEVICE}" > /dev/null; do
+        sleep 0.1
+    done
+}
+
+# 换一个空设备并挂载
+function fresh_mount() {
+    rm -f ${DEVICE}
+    do_mount
+    if [ $? -ne 0 ]; then
+        echo "mount failed" >&2
+        exit 1
+    fi
+}
+
+function run() {
+    LINE=$(${BENCH} "$@" ${MNTPOINT})
+    if [ $? -ne 0 ]; then
+        echo "failed: $*" >&2
+    fi
+    if [ -n "$LINE" ]; then
+        echo "$LINE" >&2
+        RESULTS+=("$LINE")
+    fi
+}
+
+mkdir -p ${MNTPOINT}
+
+# 元数据：扁平与深层目录
+fresh_mount
+for TREE in "-d 0" "-d ${DEPTH}"; do
+    run -n $N $TREE create
+    run -n $N $TREE stat
+    run -n $N $TREE readdir
+done
+do_umount
+
+# 数据：不同块大小的顺序与随机读写
+fresh_mount
+for BS in 4K 64K 1M; do
+    BYTES=$(numfmt --from=iec $BS)
+    run -b $BYTES -S $(numfmt --from=iec $SIZE) seqwrite
+    run -b $BYTES -S $(numfmt --from=iec $SIZE) seqread
+    run -b $BYTES -S $(numfmt --from=iec $SIZE) -n $N randwrite
+    run -b $BYTES -S $(numfmt --from=iec $SIZE) -n $N randread
+done
+do_umount
+
+# 多线程混合负载
+fresh_mount
+run -n $N -t ${THREADS} mixed
+do_umount
+
+# 重挂载耗时：建M个文件后卸载，计时挂载到首次readdir完成
+for M in $(($N / 4)) $(($N / 2)) $N; do
+    fresh_mount
+    ${BENCH} -n $M create ${MNTPOINT} > /dev/null
+    do_umount
+    START=$(date +%s%N)
+    do_mount
+    END=$(date +%s%N)
+    FIRST=$(${BENCH} -n $M -r 1 readdir ${MNTPOINT})
+    LINE=$(printf '{"workload":"remount","n":%d,"mount_secs":%s,"first_readdir":%s}' $M \
+        $(awk "BEGIN { printf \"%.6f\", ($END - $START) / 1e9 }") "${FIRST:-null}")
+    echo "$LINE" >&2
+    RESULTS+=("$LINE")
+    do_umount
+done
+
+{
+    printf '{"commit":"%s","results":[\n' "$(git rev-parse --short HEAD 2>/dev/null)"
+    for i in "${!RESULTS[@]}"; do
+        if [ $i -gt 0 ]; then
+            printf ',\n'
+        fi
+        printf '%s' "${RESULTS[$i]}"
+    done
+    printf '\n]}\n'
+} > ${OUT}
+
+rm -f ${DEVICE}
+cd $ORIGIN_WORK_DIR
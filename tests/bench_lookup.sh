@@ -0,0 +1,58 @@
+#!/bin/bash
+# 目录查找微基准：在同一目录下建N个文件，反复stat，观察单次查找耗时随N的变化
+# 用法: ./bench_lookup.sh [N...]   默认 N = 8 16 32 64 128 256
+# 挂载时关闭内核entry/attr缓存，保证每次stat都进入newfs_getattr
+ORIGIN_WORK_DIR=$PWD
+
+WORK_DIR=$(cd `dirname $0`; pwd)
+cd $WORK_DIR
+
+MNTPOINT='./mnt'
+PROJECT_NAME="newfs"
+DEVICE="$HOME"/ddriver
+ROUNDS=20
+SIZES=${@:-8 16 32 64 128 256}
+
+function bench_one() {
+    N=$1
+    ddriver -r
+    ../build/${PROJECT_NAME} --device=${DEVICE} --entry-timeout=0 --attr-timeout=0 -o negative_timeout=0 ${MNTPOINT}
+    if [ $? -ne 0 ]; then
+        echo "mount failed"
+        exit 1
+    fi
+
+    mkdir ${MNTPOINT}/bench
+    CREATED=0
+    for ((i = 0; i < N; i++)); do
+        touch ${MNTPOINT}/bench/file$i 2>/dev/null || break
+        CREATED=$(($CREATED+1))
+    done
+
+    START=$(date +%s%N)
+    for ((r = 0; r < ROUNDS; r++)); do
+        for ((i = 0; i < CREATED; i++)); do
+            echo ${MNTPOINT}/bench/file$i
+        done
+    done | xargs stat --format=%s > /dev/null
+    END=$(date +%s%N)
+
+    STATS=$(($CREATED * $ROUNDS))
+    if [ $STATS -gt 0 ]; then
+        NS=$((($END - $START) / $STATS))
+    else
+        NS=0
+    fi
+    echo "N=$N created=$CREATED stats=$STATS ns/stat=$NS"
+    if [ $CREATED -lt $N ]; then
+        echo "  (目录已满，仅创建了 $CREATED 个文件)"
+    fi
+
+    fusermount -u ${MNTPOINT}
+}
+
+for N in $SIZES; do
+    bench_one $N
+done
+
+cd $ORIGIN_WORK_DIR
@@ -0,0 +1,63 @@
+#!/bin/bash
+# 顺序读写吞吐基准：以BS为单位顺序写入SIZE字节再顺序读出，输出MB/s
+# 用法: ./bench_rw.sh [SIZE] [BS]   默认 SIZE=1M BS=128K
+# 挂载时使用direct_io，读写不经内核页缓存，直接到达newfs_read/newfs_write
+ORIGIN_WORK_DIR=$PWD
+
+WORK_DIR=$(cd `dirname $0`; pwd)
+cd $WORK_DIR
+
+MNTPOINT='./mnt'
+PROJECT_NAME="newfs"
+DEVICE="$HOME"/ddriver
+SIZE=${1:-1M}
+BS=${2:-128K}
+
+function to_bytes() {
+    numfmt --from=iec $1
+}
+
+function throughput() {
+    BYTES=$1
+    NS=$2
+    if [ $NS -le 0 ]; then
+        NS=1
+    fi
+    echo "scale=2; $BYTES * 1000000000 / $NS / 1048576" | bc
+}
+
+ddriver -r
+../build/${PROJECT_NAME} --device=${DEVICE} -o direct_io ${MNTPOINT}
+if [ $? -ne 0 ]; then
+    echo "mount failed"
+    exit 1
+fi
+
+BYTES=$(to_bytes $SIZE)
+COUNT=$(($BYTES / $(to_bytes $BS)))
+
+dd if=/dev/urandom of=/tmp/newfs_bench_src bs=$BS count=$COUNT status=none
+
+START=$(date +%s%N)
+dd if=/tmp/newfs_bench_src of=${MNTPOINT}/bench bs=$BS count=$COUNT conv=fsync status=none
+WRITE_RET=$?
+END=$(date +%s%N)
+WRITE_NS=$(($END - $START))
+
+START=$(date +%s%N)
+dd if=${MNTPOINT}/bench of=/tmp/newfs_bench_dst bs=$BS status=none
+READ_RET=$?
+END=$(date +%s%N)
+READ_NS=$(($END - $START))
+
+if [ $WRITE_RET -ne 0 ] || [ $READ_RET -ne 0 ]; then
+    echo "write/read failed (size=$SIZE bs=$BS)"
+elif ! cmp -s /tmp/newfs_bench_src /tmp/newfs_bench_dst; then
+    echo "data mismatch (size=$SIZE bs=$BS)"
+else
+    echo "size=$SIZE bs=$BS write=$(throughput $BYTES $WRITE_NS)MB/s read=$(throughput $BYTES $READ_NS)MB/s"
+fi
+
+rm -f /tmp/newfs_bench_src /tmp/newfs_bench_dst
+fusermount -u ${MNTPOINT}
+cd $ORIGIN_WORK_DIR
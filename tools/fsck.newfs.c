@@ -0,0 +1,706 @@
+#include "newfs.h"
+#include <getopt.h>
+#include <stdarg.h>
+#include <time.h>
+
+/******************************************************************************
+* SECTION: fsck.newfs，离线检查目录树、inode表与位图的一致性，并按可达性重建位图
+* 用法: fsck.newfs [-n] [-j 线程数] <ddriver设备路径>，须在卸载状态下运行
+*   -n  只检查：不重放日志、不写设备
+*   -j  扫描线程数，默认CPU数，至多FSCK_THREADS_MAX
+* 第1遍：各块组的两个位图块与inode表（到最后一个已用inode所在块为止）一次顺序读入，按组并行
+* 第2遍：自根目录按层遍历，同层的目录并行读入目录块（按块号排序合并为大段读）并解析
+* 第3遍：可达inode并行检查extent，标记其数据块与extent块
+* 第4遍：与磁盘上的位图比较，改写不一致的块组。有无法修复的错误时只补标可达而被标为空闲的位，
+* 不释放任何位，以免误放掉解析失败的目录下的文件
+* 退出码: 0 无错误，1 已修复（含重放日志），4 有未修复的错误，8 无法检查
+*******************************************************************************/
+extern struct newfs_super super;
+
+struct fsck_ent {
+	int ino;
+	int ftype;
+	int name;						/* 文件名在names中的偏移 */
+};
+
+// 一个目录的解析结果
+struct fsck_dir {
+	int ino;
+	int cnt;
+	int cap;
+	struct fsck_ent* ents;
+	char* names;
+	int names_len;
+	int names_cap;
+};
+
+static int nthreads;
+static int dry_run;
+static int errors;							/* 未修复的错误数，原子更新 */
+static long read_blks;						/* 读入的设备块数，原子更新 */
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct newfs_dinode* itab;			/* 全部磁盘inode，按ino下标 */
+static uint8_t* iread;						/* itab中各项是否已读入 */
+static uint8_t* disk_imap;					/* 磁盘上的位图 */
+static uint8_t* disk_dmap;
+static uint8_t* new_imap;					/* 按可达性重建的位图 */
+static uint8_t* new_dmap;
+static int* parent;							/* 可达inode的上级目录，-1为未到达 */
+static int* reached;						/* 可达inode，根目录在前 */
+static int* subdirs;						/* 可达目录的子目录数，决定其应有的链接数 */
+static int reached_cnt;
+static int dir_cnt;
+
+static int* level;							/* 第2遍当前层的目录 */
+static struct fsck_dir* scans;
+
+/******************************************************************************
+* SECTION: 内部函数
+*******************************************************************************/
+static void problem(const char* fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&out_lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	++errors;
+	pthread_mutex_unlock(&out_lock);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 并行执行fn(0..n-1)，线程各自领取下标
+struct fsck_job {
+	int n;
+	int next;
+	void (*fn)(int);
+};
+
+static void* job_worker(void* arg)
+{
+	struct fsck_job* job = (struct fsck_job*)arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n)
+		job->fn(i);
+	return NULL;
+}
+
+static void parallel_for(int n, void (*fn)(int))
+{
+	struct fsck_job job = { n, 0, fn };
+	pthread_t tids[FSCK_THREADS_MAX];
+	int cnt = 0;
+
+	for (int i = 1; i < nthreads && i < n; ++i)
+		if (pthread_create(&tids[cnt], NULL, job_worker, &job) == 0)
+			++cnt;
+	job_worker(&job);
+	for (int i = 0; i < cnt; ++i)
+		pthread_join(tids[i], NULL);
+}
+
+// 读设备块，vec调用后顺序被打乱，各缓冲区仍与其块号对应
+static void dev_readv(struct newfs_iovec* vec, int cnt)
+{
+	newfs_io_submit(vec, cnt, NEWFS_IO_READ);
+	__atomic_add_fetch(&read_blks, cnt, __ATOMIC_RELAXED);
+}
+
+// 读连续的cnt个设备块
+static void dev_read(int blkno, int cnt, uint8_t* buf)
+{
+	struct newfs_iovec* vec = (struct newfs_iovec*)malloc(cnt * sizeof(struct newfs_iovec));
+
+	for (int i = 0; i < cnt; ++i)
+	{
+		vec[i].blkno = blkno + i;
+		vec[i].buf = buf + i * super.dev_io_sz;
+	}
+	dev_readv(vec, cnt);
+	free(vec);
+}
+
+static int bit_get(const uint8_t* map, int bit)
+{
+	return (map[bit / 8] >> (bit % 8)) & 1;
+}
+
+// 置位，返回原值
+static int bit_mark(uint8_t* map, int bit)
+{
+	uint8_t mask = 1 << (bit % 8);
+	return (__atomic_fetch_or(&map[bit / 8], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+// 第g组的数据块数，最后一组可能较少
+static int group_blocks(int g)
+{
+	int left = super.max_data - g * super.blocks_per_group;
+	return left < super.blocks_per_group ? left : super.blocks_per_group;
+}
+
+static int dinode_ok(int ino)
+{
+	const struct newfs_dinode* d = &itab[ino];
+	return d->ino == ino && (d->ftype == DIR || d->ftype == MYFILE) && d->size >= 0;
+}
+
+// 读入ino所在设备块的全部inode，只在串行阶段调用
+static void dinode_fetch(int ino)
+{
+	int io_sz = super.dev_io_sz;
+	int ipg = super.inodes_per_group;
+	int per = io_sz / NEWFS_DINODE_SZ;
+	int base = ino - ino % ipg;
+	int first = ino % ipg / per * per;
+	int cnt = ipg - first < per ? ipg - first : per;
+	uint8_t* buf = (uint8_t*)malloc(io_sz);
+
+	if (iread[ino])
+	{
+		free(buf);
+		return;
+	}
+	dev_read(newfs_ino_off(&super, base + first) / io_sz, 1, buf);
+	memcpy(itab + base + first, buf, cnt * NEWFS_DINODE_SZ);
+	memset(iread + base + first, 1, cnt);
+	free(buf);
+}
+
+/**
+ * 读出inode的全部extent并检查：extent块号与长度在范围内，按逻辑块号升序且不重叠。
+ * extent块号存入leaf（不足INODE_EXTENT_NUM个时其余为0）
+ *
+ * @param quiet 不报告错误（第2遍读目录时，错误留到第3遍统一报告）
+ * @return int extent数，有错误返回-1，out由调用者释放
+ */
+static int ext_load(int ino, struct newfs_extent** out, int* leaf, int quiet)
+{
+	const struct newfs_dinode* d = &itab[ino];
+	int per = 2 * super.dev_io_sz / (int)sizeof(struct newfs_extent);
+	int cnt = d->extent_cnt;
+	struct newfs_extent* map;
+
+	*out = NULL;
+	memset(leaf, 0, INODE_EXTENT_NUM * sizeof(int));
+	if (cnt < 0 || (d->extent_depth == 0 && cnt > INODE_EXTENT_NUM)
+		|| (d->extent_depth == 1 && cnt > INODE_EXTENT_NUM * per) || d->extent_depth < 0 || d->extent_depth > 1)
+	{
+		if (!quiet)
+			problem("inode %d: bad extent count %d (depth %d)\n", ino, cnt, d->extent_depth);
+		return -1;
+	}
+	map = (struct newfs_extent*)malloc((cnt ? cnt : 1) * sizeof(struct newfs_extent));
+	if (d->extent_depth == 0)
+		memcpy(map, d->extents, cnt * sizeof(struct newfs_extent));
+	else
+	{
+		// extent块一次读入
+		struct newfs_iovec vec[2 * INODE_EXTENT_NUM];
+		uint8_t* buf = (uint8_t*)malloc(INODE_EXTENT_NUM * 2 * super.dev_io_sz);
+		int nleaf = 0, n = 0;
+		for (int i = 0; i < INODE_EXTENT_NUM && n < cnt; ++i, ++nleaf)
+		{
+			const struct newfs_extent* idx = &d->extents[i];
+			if (idx->pblk <= 0 || idx->pblk >= super.max_data || idx->len <= 0 || idx->len > per || n + idx->len > cnt)
+			{
+				if (!quiet)
+					problem("inode %d: bad extent block %d (%d extents)\n", ino, idx->pblk, idx->len);
+				free(buf);
+				free(map);
+				return -1;
+			}
+			int blkno = newfs_blk_off(&super, idx->pblk) / super.dev_io_sz;
+			for (int k = 0; k < 2; ++k)
+			{
+				vec[2 * i + k].blkno = blkno + k;
+				vec[2 * i + k].buf = buf + (2 * i + k) * super.dev_io_sz;
+			}
+			leaf[i] = idx->pblk;
+			n += idx->len;
+		}
+		if (n < cnt)
+		{
+			if (!quiet)
+				problem("inode %d: extent blocks hold %d of %d extents\n", ino, n, cnt);
+			free(buf);
+			free(map);
+			return -1;
+		}
+		dev_readv(vec, 2 * nleaf);
+		for (int i = 0, m = 0; i < nleaf; m += d->extents[i].len, ++i)
+			memcpy(map + m, buf + 2 * i * super.dev_io_sz, d->extents[i].len * sizeof(struct newfs_extent));
+		free(buf);
+	}
+
+	for (int i = 0; i < cnt; ++i)
+	{
+		const struct newfs_extent* e = &map[i];
+		if (e->len <= 0 || e->lblk < 0 || e->pblk <= 0 || (long)e->pblk + e->len > super.max_data
+			|| (i > 0 && e->lblk < map[i - 1].lblk + map[i - 1].len))
+		{
+			if (!quiet)
+				problem("inode %d: bad extent %d: lblk %d pblk %d len %d\n", ino, i, e->lblk, e->pblk, e->len);
+			free(map);
+			return -1;
+		}
+	}
+	*out = map;
+	return cnt;
+}
+
+static void dir_add(struct fsck_dir* s, const struct newfs_dentry* de)
+{
+	int len = strlen(de->name) + 1;
+
+	if (s->cnt == s->cap)
+	{
+		s->cap = s->cap ? 2 * s->cap : 16;
+		s->ents = (struct fsck_ent*)realloc(s->ents, s->cap * sizeof(struct fsck_ent));
+	}
+	if (s->names_len + len > s->names_cap)
+	{
+		s->names_cap = s->names_cap ? 2 * s->names_cap : 256;
+		while (s->names_len + len > s->names_cap)
+			s->names_cap *= 2;
+		s->names = (char*)realloc(s->names, s->names_cap);
+	}
+	s->ents[s->cnt].ino = de->ino;
+	s->ents[s->cnt].ftype = de->ftype;
+	s->ents[s->cnt].name = s->names_len;
+	memcpy(s->names + s->names_len, de->name, len);
+	s->names_len += len;
+	++s->cnt;
+}
+
+/******************************************************************************
+* SECTION: 第1遍：位图与inode表
+*******************************************************************************/
+static void pass1_group(int g)
+{
+	int io_sz = super.dev_io_sz;
+	int ipg = super.inodes_per_group;
+	int per = io_sz / NEWFS_DINODE_SZ;
+	int start = newfs_imap_off(&super, g) / io_sz;
+	int last = -1;
+	uint8_t* buf = (uint8_t*)malloc(2 * io_sz);
+
+	// 两个位图块与inode表相邻，先读位图再接着读inode表，磁头不回退
+	dev_read(start, 2, buf);
+	memcpy(disk_imap + g * ipg / 8, buf, ipg / 8);
+	memcpy(disk_dmap + g * super.blocks_per_group / 8, buf + io_sz, group_blocks(g) / 8);
+	for (int i = ipg - 1; i >= 0 && last < 0; --i)
+		if (bit_get(disk_imap, g * ipg + i))
+			last = i;
+	if (last >= 0)
+	{
+		int blks = last / per + 1;
+		int cnt = blks * per < ipg ? blks * per : ipg;
+		buf = (uint8_t*)realloc(buf, blks * io_sz);
+		dev_read(start + 2, blks, buf);
+		memcpy(itab + g * ipg, buf, cnt * NEWFS_DINODE_SZ);
+		memset(iread + g * ipg, 1, cnt);
+	}
+	free(buf);
+}
+
+/******************************************************************************
+* SECTION: 第2遍：目录树
+*******************************************************************************/
+// 读入并解析一个目录的全部目录块
+static void pass2_dir(int i)
+{
+	struct fsck_dir* s = &scans[i];
+	const struct newfs_dinode* d = &itab[level[i]];
+	int io_sz = super.dev_io_sz;
+	int blk_sz = 2 * io_sz;
+	int blk_num = CEIL(d->size, blk_sz);
+	int blk_max = blk_sz / DIRENT_LEN(1);
+	int leaf[INODE_EXTENT_NUM];
+	struct newfs_extent* map;
+	int ext_cnt = ext_load(level[i], &map, leaf, 1);
+	struct newfs_dentry* decoded = (struct newfs_dentry*)malloc(blk_max * sizeof(struct newfs_dentry));
+	struct newfs_iovec* vec = (struct newfs_iovec*)malloc(FSCK_READ_BLKS * sizeof(struct newfs_iovec));
+	uint8_t* buf = (uint8_t*)malloc(FSCK_READ_BLKS * io_sz);
+	int e = 0;
+
+	s->ino = level[i];
+	if (ext_cnt < 0)
+		goto out;
+	// 每批至多FSCK_READ_BLKS个设备块，排序合并后为少数几段大的顺序读
+	for (int first = 0; first < blk_num; first += FSCK_READ_BLKS / 2)
+	{
+		int cnt = blk_num - first < FSCK_READ_BLKS / 2 ? blk_num - first : FSCK_READ_BLKS / 2;
+		int pblk[FSCK_READ_BLKS / 2];
+		int nvec = 0;
+		for (int k = 0; k < cnt; ++k)
+		{
+			int lblk = first + k;
+			while (e < ext_cnt && map[e].lblk + map[e].len <= lblk)
+				++e;
+			pblk[k] = e < ext_cnt && map[e].lblk <= lblk ? map[e].pblk + lblk - map[e].lblk : 0;
+			if (pblk[k] == 0)
+			{
+				problem("directory %d: block %d is not mapped\n", s->ino, lblk);
+				continue;
+			}
+			int blkno = newfs_blk_off(&super, pblk[k]) / io_sz;
+			vec[nvec].blkno = blkno;
+			vec[nvec++].buf = buf + 2 * k * io_sz;
+			vec[nvec].blkno = blkno + 1;
+			vec[nvec++].buf = buf + (2 * k + 1) * io_sz;
+		}
+		dev_readv(vec, nvec);
+		for (int k = 0; k < cnt; ++k)
+		{
+			int lblk = first + k;
+			int used = lblk == blk_num - 1 ? d->size - lblk * blk_sz : blk_sz;
+			if (pblk[k] == 0)
+				continue;
+			int n = newfs_dirent_decode(buf + 2 * k * io_sz, used, decoded, blk_max);
+			for (int j = 0; j < n; ++j)
+				dir_add(s, decoded + j);
+		}
+	}
+	if (s->cnt != d->dir_cnt)
+		problem("directory %d: %d entries found, inode records %d\n", s->ino, s->cnt, d->dir_cnt);
+out:
+	free(map);
+	free(buf);
+	free(vec);
+	free(decoded);
+}
+
+// 串行合并一层的解析结果，连上可达的子项，返回下一层的目录数（存于level）
+static int pass2_merge(int cnt)
+{
+	int next = 0;
+
+	for (int i = 0; i < cnt; ++i)
+	{
+		struct fsck_dir* s = &scans[i];
+		for (int j = 0; j < s->cnt; ++j)
+		{
+			struct fsck_ent* ent = &s->ents[j];
+			const char* name = s->names + ent->name;
+			if (ent->ino <= 0 || ent->ino >= super.max_ino)
+			{
+				problem("directory %d: entry '%s' points to invalid inode %d\n", s->ino, name, ent->ino);
+				continue;
+			}
+			if (parent[ent->ino] >= 0)
+			{
+				problem("directory %d: entry '%s' links inode %d, already linked from directory %d\n",
+						s->ino, name, ent->ino, parent[ent->ino]);
+				continue;
+			}
+			dinode_fetch(ent->ino);
+			if (!dinode_ok(ent->ino))
+			{
+				problem("directory %d: entry '%s' points to unused inode %d\n", s->ino, name, ent->ino);
+				continue;
+			}
+			if (itab[ent->ino].ftype != ent->ftype)
+				problem("directory %d: entry '%s' has type %d, inode %d has type %d\n",
+						s->ino, name, ent->ftype, ent->ino, itab[ent->ino].ftype);
+			parent[ent->ino] = s->ino;
+			reached[reached_cnt++] = ent->ino;
+			if (itab[ent->ino].ftype == DIR)
+			{
+				level[next++] = ent->ino;
+				++subdirs[s->ino];
+			}
+		}
+		free(s->ents);
+		free(s->names);
+	}
+	return next;
+}
+
+// 按层遍历目录树，同层目录并行解析
+static void pass2(void)
+{
+	int cnt = 1;
+
+	level = (int*)malloc(super.max_ino * sizeof(int));
+	level[0] = 0;
+	parent[0] = 0;
+	reached[reached_cnt++] = 0;
+	while (cnt > 0)
+	{
+		dir_cnt += cnt;
+		scans = (struct fsck_dir*)calloc(cnt, sizeof(struct fsck_dir));
+		parallel_for(cnt, pass2_dir);
+		cnt = pass2_merge(cnt);
+		free(scans);
+	}
+	free(level);
+}
+
+/******************************************************************************
+* SECTION: 第3遍：可达inode的extent与数据块
+*******************************************************************************/
+static void mark_block(int ino, int bno)
+{
+	if (bit_mark(new_dmap, bno))
+		problem("inode %d: block %d is also used by another inode\n", ino, bno);
+}
+
+static void pass3_inode(int i)
+{
+	int ino = reached[i];
+	const struct newfs_dinode* d = &itab[ino];
+	int leaf[INODE_EXTENT_NUM];
+	struct newfs_extent* map;
+	int cnt;
+
+	bit_mark(new_imap, ino);
+	// 目录：自身的.与上级中的目录项，加上每个子目录的..
+	int nlink = d->ftype == DIR ? 2 + subdirs[ino] : 1;
+	if (d->nlink != nlink)
+		problem("inode %d: link count %d, expected %d\n", ino, d->nlink, nlink);
+	cnt = ext_load(ino, &map, leaf, 0);
+	if (cnt < 0)
+		return;
+	for (int k = 0; k < INODE_EXTENT_NUM && leaf[k]; ++k)
+		mark_block(ino, leaf[k]);
+	for (int k = 0; k < cnt; ++k)
+		for (int b = 0; b < map[k].len; ++b)
+			mark_block(ino, map[k].pblk + b);
+	free(map);
+}
+
+/******************************************************************************
+* SECTION: 第4遍：位图
+*******************************************************************************/
+// 比较一段位图，统计磁盘上标为已用而不可达、可达而标为空闲的位数
+static void map_diff(const uint8_t* disk, const uint8_t* rebuilt, int bytes, long* leaked, long* missing)
+{
+	for (int i = 0; i < bytes; ++i)
+	{
+		*leaked += __builtin_popcount(disk[i] & ~rebuilt[i] & 0xff);
+		*missing += __builtin_popcount(rebuilt[i] & ~disk[i] & 0xff);
+	}
+}
+
+/**
+ * 比较并改写位图，返回改写的位图块数
+ *
+ * @param keep 为1时保留磁盘上已标的位，只补标缺失的位
+ */
+static int pass4(int keep)
+{
+	int io_sz = super.dev_io_sz;
+	int ipg = super.inodes_per_group;
+	int bpg = super.blocks_per_group;
+	long i_leaked = 0, i_missing = 0, b_leaked = 0, b_missing = 0;
+	struct newfs_iovec* vec = (struct newfs_iovec*)malloc(2 * super.group_cnt * sizeof(struct newfs_iovec));
+	uint8_t* buf = (uint8_t*)calloc(2 * super.group_cnt, io_sz);
+	int cnt = 0;
+
+	for (int g = 0; g < super.group_cnt; ++g)
+	{
+		long il = 0, im = 0, bl = 0, bm = 0;
+		int dbytes = group_blocks(g) / 8;
+		uint8_t* imap = new_imap + g * ipg / 8;
+		uint8_t* dmap = new_dmap + g * bpg / 8;
+		map_diff(disk_imap + g * ipg / 8, imap, ipg / 8, &il, &im);
+		map_diff(disk_dmap + g * bpg / 8, dmap, dbytes, &bl, &bm);
+		i_leaked += il;
+		i_missing += im;
+		b_leaked += bl;
+		b_missing += bm;
+		if (keep)
+		{
+			for (int k = 0; k < ipg / 8; ++k)
+				imap[k] |= disk_imap[g * ipg / 8 + k];
+			for (int k = 0; k < dbytes; ++k)
+				dmap[k] |= disk_dmap[g * bpg / 8 + k];
+		}
+		// 位图块中段之外的部分格式化时为0
+		if (im || (il && !keep))
+		{
+			memcpy(buf + cnt * io_sz, imap, ipg / 8);
+			vec[cnt].blkno = newfs_imap_off(&super, g) / io_sz;
+			vec[cnt].buf = buf + cnt * io_sz;
+			++cnt;
+		}
+		if (bm || (bl && !keep))
+		{
+			memcpy(buf + cnt * io_sz, dmap, dbytes);
+			vec[cnt].blkno = newfs_dmap_off(&super, g) / io_sz;
+			vec[cnt].buf = buf + cnt * io_sz;
+			++cnt;
+		}
+	}
+	if (i_leaked || i_missing)
+		printf("inode bitmap: %ld reachable inodes marked free, %ld unreachable inodes marked in use\n",
+			   i_missing, i_leaked);
+	if (b_leaked || b_missing)
+		printf("block bitmap: %ld used blocks marked free, %ld unused blocks marked in use\n",
+			   b_missing, b_leaked);
+	if (dry_run)
+	{
+		if (cnt)
+			problem("bitmaps differ in %d blocks, not rewritten (-n)\n", cnt);
+		cnt = 0;
+	}
+	else if (cnt)
+	{
+		newfs_io_submit(vec, cnt, NEWFS_IO_WRITE);
+		printf("bitmaps rewritten in %d blocks%s\n", cnt, keep ? ", unowned bits kept because of the errors above" : "");
+	}
+	free(buf);
+	free(vec);
+	return cnt;
+}
+
+/******************************************************************************
+* SECTION: 日志
+*******************************************************************************/
+// 日志tail处是否有待重放的事务（-n时不重放，只提示）
+static int journal_pending(void)
+{
+	int io_sz = super.dev_io_sz;
+	int start = super.journal_offset / io_sz;
+	uint8_t* buf = (uint8_t*)malloc(2 * io_sz);
+	struct newfs_jsuper* js = (struct newfs_jsuper*)buf;
+	struct newfs_jdesc* desc = (struct newfs_jdesc*)(buf + io_sz);
+	int pending = 0;
+
+	dev_read(start, 1, buf);
+	if (js->magic == JSUPER_MAGIC && js->tail >= 1 && js->tail < super.journal_blks)
+	{
+		dev_read(start + js->tail, 1, buf + io_sz);
+		pending = (desc->magic == JDESC_MAGIC || desc->magic == JWRAP_MAGIC) && desc->seq == js->seq;
+	}
+	free(buf);
+	return pending;
+}
+
+/******************************************************************************
+* SECTION: 入口
+*******************************************************************************/
+static void usage(const char* prog)
+{
+	fprintf(stderr, "usage: %s [-n] [-j threads] <device>\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+	int opt, modified = 0, rewritten;
+	double start = now_sec();
+	long used_blocks = 0;
+
+	nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "nj:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 8;
+		}
+	}
+	if (optind != argc - 1)
+	{
+		usage(argv[0]);
+		return 8;
+	}
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > FSCK_THREADS_MAX)
+		nthreads = FSCK_THREADS_MAX;
+
+	if (newfs_super_open(argv[0], argv[optind], 0) < 0)
+		return 8;
+
+	// 已提交的元数据事务先写回原位
+	if (super.journal_blks > 0)
+	{
+		if (dry_run)
+		{
+			if (journal_pending())
+				printf("journal has transactions that are not replayed (-n), results may be stale\n");
+		}
+		else
+		{
+			newfs_cache_init(CACHE_BLK_NUM);
+			int n = newfs_journal_load();
+			newfs_cache_destroy();
+			if (n > 0)
+			{
+				printf("replayed %d journal transactions\n", n);
+				modified = 1;
+			}
+		}
+	}
+
+	itab = (struct newfs_dinode*)calloc(super.max_ino, sizeof(struct newfs_dinode));
+	iread = (uint8_t*)calloc(super.max_ino, 1);
+	disk_imap = (uint8_t*)calloc(super.max_ino / 8, 1);
+	disk_dmap = (uint8_t*)calloc(super.max_data / 8, 1);
+	new_imap = (uint8_t*)calloc(super.max_ino / 8, 1);
+	new_dmap = (uint8_t*)calloc(super.max_data / 8, 1);
+	parent = (int*)malloc(super.max_ino * sizeof(int));
+	memset(parent, -1, super.max_ino * sizeof(int));
+	reached = (int*)malloc(super.max_ino * sizeof(int));
+	subdirs = (int*)calloc(super.max_ino, sizeof(int));
+
+	parallel_for(super.group_cnt, pass1_group);
+
+	// 根目录项固定在0号数据块
+	uint8_t* root_blk = (uint8_t*)malloc(2 * super.dev_io_sz);
+	struct newfs_dentry root;
+	dev_read(newfs_blk_off(&super, 0) / super.dev_io_sz, 2, root_blk);
+	if (newfs_dirent_decode(root_blk, 2 * super.dev_io_sz, &root, 1) != 1 || root.ino != 0 || root.ftype != DIR)
+		problem("root entry in block 0 is damaged\n");
+	free(root_blk);
+	bit_mark(new_dmap, 0);
+	dinode_fetch(0);
+	if (!dinode_ok(0) || itab[0].ftype != DIR)
+	{
+		problem("root inode is damaged, cannot check the directory tree\n");
+		newfs_super_close();
+		return 4;
+	}
+
+	pass2();
+	parallel_for(reached_cnt, pass3_inode);
+	for (int i = 0; i < super.max_data / 8; ++i)
+		used_blocks += __builtin_popcount(new_dmap[i]);
+	rewritten = pass4(errors > 0);
+	modified |= rewritten > 0;
+	printf("%s: %d/%d inodes (%d directories), %ld/%d blocks, %ld KiB read by %d threads in %.2fs\n",
+		   argv[optind], reached_cnt, super.max_ino, dir_cnt, used_blocks, super.max_data,
+		   read_blks * super.dev_io_sz / 1024, nthreads, now_sec() - start);
+	newfs_super_close();
+
+	free(itab);
+	free(iread);
+	free(disk_imap);
+	free(disk_dmap);
+	free(new_imap);
+	free(new_dmap);
+	free(parent);
+	free(reached);
+	free(subdirs);
+	if (errors > 0)
+		return 4;
+	return modified ? 1 : 0;
+}
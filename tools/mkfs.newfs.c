@@ -0,0 +1,81 @@
+#include "newfs.h"
+#include <getopt.h>
+
+/******************************************************************************
+* SECTION: mkfs.newfs，按设备大小格式化
+* 用法: mkfs.newfs [-i 每inode字节数] [-n] <ddriver设备路径>
+* 设备至多INT_MAX个IO单位
+*   -i  每多少字节设备空间配一个inode，默认NEWFS_BYTES_PER_INODE
+*   -n  只打印布局，不写设备
+*******************************************************************************/
+static void usage(const char* prog)
+{
+	fprintf(stderr, "usage: %s [-i bytes-per-inode] [-n] <device>\n", prog);
+}
+
+static void print_geometry(const struct newfs_super* sb, off_t disk_sz, int io_sz)
+{
+	printf("device:         %lld bytes, io unit %d\n", (long long)disk_sz, io_sz);
+	printf("bytes/inode:    %d\n", sb->bytes_per_inode);
+	printf("inodes:         %d (%d per group)\n", sb->max_ino, sb->inodes_per_group);
+	printf("data blocks:    %d x %d bytes (%d per group)\n", sb->max_data, 2 * io_sz, sb->blocks_per_group);
+	printf("journal:        %d blocks @ %lld\n", sb->journal_blks, (long long)sb->journal_offset);
+	printf("groups:         %d x %d blocks @ %lld (inode table %d blocks)\n",
+		   sb->group_cnt, sb->group_blks, (long long)sb->group_offset, sb->itable_blks);
+}
+
+int main(int argc, char** argv)
+{
+	int bytes_per_inode = NEWFS_BYTES_PER_INODE;
+	int dry_run = 0;
+	off_t disk_sz;
+	int io_sz;
+	int opt, fd, ret;
+	struct newfs_super sb;
+
+	while ((opt = getopt(argc, argv, "i:n")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			bytes_per_inode = atoi(optarg);
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || bytes_per_inode <= 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = ddriver_open(argv[optind]);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], argv[optind], strerror(errno));
+		return 1;
+	}
+	disk_sz = newfs_dev_size(fd);
+	ddriver_ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &io_sz);
+
+	memset(&sb, 0, sizeof(sb));
+	if (disk_sz < 0)
+		ret = (int)disk_sz;
+	else if (dry_run)
+		ret = newfs_geometry(&sb, disk_sz, io_sz, bytes_per_inode);
+	else
+		ret = newfs_format(fd, disk_sz, io_sz, bytes_per_inode, &sb);
+	ddriver_close(fd);
+	if (ret < 0)
+	{
+		fprintf(stderr, "%s: format failed: %s\n", argv[0], strerror(-ret));
+		return 1;
+	}
+	print_geometry(&sb, disk_sz, io_sz);
+	return 0;
+}
@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/******************************************************************************
+* SECTION: newfs_bench，在挂载点上运行一项负载，结果以一行JSON输出到标准输出。
+* 只经POSIX接口访问文件系统，挂载、卸载与汇总由tests/bench.sh完成。
+* 用法: newfs_bench [选项] <负载> <目录>
+*   负载      create | stat | readdir            N个文件的名字空间，-d为0时在同一目录（flat），
+*                                                否则分布在深度为d的目录链上（deep）
+*             seqwrite | seqread                 以bs为单位顺序写/读大小为size的文件
+*             randwrite | randread               在该文件内按bs对齐的随机偏移写/读N次
+*             mixed                              t个线程各执行N次stat/create/写/读的混合操作
+*   -n N      文件数或操作次数，默认1000
+*   -d depth  目录链深度，默认0
+*   -b bs     读写单位（字节，可带K/M后缀），默认4K
+*   -S size   数据文件大小，默认16M
+*   -t T      线程数（mixed），默认4
+*   -r R      readdir轮数，默认10
+*   -R seed   随机种子，默认1，相同种子的偏移与操作序列相同
+*   -s path   newfs统计文件，默认<目录>/.newfs_stats；存在时输出本项负载引起的设备IO计数
+*******************************************************************************/
+#define NAME_SZ		4096
+
+struct bench {
+	const char* workload;
+	const char* dir;
+	const char* stats;
+	int n;
+	int depth;
+	long bs;
+	long size;
+	int threads;
+	int rounds;
+	unsigned long seed;
+};
+
+// 一组操作的时延样本
+struct lat {
+	long* ns;
+	int cnt;
+	int errors;
+};
+
+// 设备IO计数，取自统计文件各操作行之和
+struct dev_cnt {
+	long read;
+	long write;
+	long seek;
+};
+
+// mixed中一个线程的参数与结果
+struct worker {
+	struct bench* b;
+	int id;
+	struct lat lat;
+};
+
+/******************************************************************************
+* SECTION: 工具函数
+*******************************************************************************/
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// xorshift，结果只依赖种子
+static unsigned long next_rand(unsigned long* s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static long parse_size(const char* s)
+{
+	char* end;
+	long v = strtol(s, &end, 0);
+	switch (*end)
+	{
+	case 'G': case 'g': v <<= 10; /* fall through */
+	case 'M': case 'm': v <<= 10; /* fall through */
+	case 'K': case 'k': v <<= 10; break;
+	default: break;
+	}
+	return v;
+}
+
+static void lat_init(struct lat* l, int cap)
+{
+	l->ns = (long*)malloc((cap > 0 ? cap : 1) * sizeof(long));
+	l->cnt = 0;
+	l->errors = 0;
+}
+
+static void lat_add(struct lat* l, long start, int ok)
+{
+	l->ns[l->cnt++] = now_ns() - start;
+	if (!ok)
+		++l->errors;
+}
+
+static int long_cmp(const void* a, const void* b)
+{
+	long x = *(const long*)a, y = *(const long*)b;
+	return (x > y) - (x < y);
+}
+
+static double quantile_us(struct lat* l, double q)
+{
+	int i = (int)(q * (l->cnt - 1) + 0.5);
+	return l->cnt ? l->ns[i] / 1000.0 : 0;
+}
+
+// 读统计文件，累加各操作行的dev_read/dev_write/seeks列；不可读时返回-1
+static int dev_read_cnt(const char* path, struct dev_cnt* c)
+{
+	char line[512], op[32];
+	long calls, rd, wr, sk;
+	double avg, p50, p99, max;
+	FILE* f = fopen(path, "r");
+
+	memset(c, 0, sizeof(struct dev_cnt));
+	if (f == NULL)
+		return -1;
+	if (fgets(line, sizeof(line), f) == NULL)
+	{
+		fclose(f);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, "%31s %ld %lf %lf %lf %lf %ld %ld %ld", op, &calls, &avg, &p50, &p99, &max, &rd, &wr, &sk) != 9)
+			continue;
+		c->read += rd;
+		c->write += wr;
+		c->seek += sk;
+	}
+	fclose(f);
+	return 0;
+}
+
+// 第i个文件的路径；deep时先建好所在目录链
+static void file_path(struct bench* b, int i, char* out, int mkdirs)
+{
+	int len;
+
+	if (b->depth == 0)
+	{
+		snprintf(out, NAME_SZ, "%s/flat/f%d", b->dir, i);
+		return;
+	}
+	len = snprintf(out, NAME_SZ, "%s/deep%d", b->dir, b->depth);
+	for (int l = 0; l <= i % b->depth; ++l)
+	{
+		len += snprintf(out + len, NAME_SZ - len, "/l%d", l);
+		if (mkdirs)
+			mkdir(out, 0755);
+	}
+	snprintf(out + len, NAME_SZ - len, "/f%d", i);
+}
+
+/******************************************************************************
+* SECTION: 负载
+*******************************************************************************/
+static void run_create(struct bench* b, struct lat* l)
+{
+	char path[NAME_SZ];
+
+	snprintf(path, NAME_SZ, b->depth ? "%s/deep%d" : "%s/flat", b->dir, b->depth);
+	mkdir(path, 0755);
+	for (int i = 0; i < b->n; ++i)
+	{
+		file_path(b, i, path, 1);
+		long t = now_ns();
+		int fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd >= 0)
+			close(fd);
+		lat_add(l, t, fd >= 0);
+	}
+}
+
+static void run_stat(struct bench* b, struct lat* l)
+{
+	char path[NAME_SZ];
+	struct stat st;
+
+	for (int i = 0; i < b->n; ++i)
+	{
+		file_path(b, i, path, 0);
+		long t = now_ns();
+		lat_add(l, t, stat(path, &st) == 0);
+	}
+}
+
+// 每轮列出名字空间中的全部目录，一次完整列出计一次操作
+static void run_readdir(struct bench* b, struct lat* l)
+{
+	char path[NAME_SZ];
+
+	for (int r = 0; r < b->rounds; ++r)
+	{
+		int len = snprintf(path, NAME_SZ, b->depth ? "%s/deep%d" : "%s/flat", b->dir, b->depth);
+		for (int lv = 0; lv <= b->depth; ++lv)
+		{
+			if (lv > 0)
+				len += snprintf(path + len, NAME_SZ - len, "/l%d", lv - 1);
+			long t = now_ns();
+			DIR* d = opendir(path);
+			if (d)
+			{
+				while (readdir(d))
+					;
+				closedir(d);
+			}
+			lat_add(l, t, d != NULL);
+		}
+	}
+}
+
+static void run_data(struct bench* b, struct lat* l, int write, int random)
+{
+	char path[NAME_SZ];
+	long blks = b->size / b->bs;
+	int ops = random ? b->n : (int)blks;
+	unsigned long seed = b->seed;
+	char* buf = (char*)malloc(b->bs);
+	int fd;
+
+	snprintf(path, NAME_SZ, "%s/data_%ld", b->dir, b->bs);
+	fd = open(path, write ? O_CREAT | O_WRONLY : O_RDONLY, 0644);
+	if (fd < 0 || blks == 0)
+	{
+		l->errors = ops;
+		free(buf);
+		return;
+	}
+	for (long i = 0; i < b->bs; ++i)
+		buf[i] = (char)next_rand(&seed);
+	for (int i = 0; i < ops; ++i)
+	{
+		off_t off = (off_t)(random ? next_rand(&seed) % blks : (unsigned long)i) * b->bs;
+		long t = now_ns();
+		ssize_t ret = write ? pwrite(fd, buf, b->bs, off) : pread(fd, buf, b->bs, off);
+		lat_add(l, t, ret == b->bs);
+	}
+	if (write)
+		fsync(fd);
+	close(fd);
+	free(buf);
+}
+
+// 操作分布：40% stat共享目录或本线程的文件，20%新建，20%写、20%读本线程的文件，各4K
+static void* mixed_worker(void* arg)
+{
+	struct worker* w = (struct worker*)arg;
+	struct bench* b = w->b;
+	unsigned long seed = b->seed + w->id * 7919;
+	char path[NAME_SZ];
+	char buf[4096];
+	int created = 0;
+	struct stat st;
+
+	lat_init(&w->lat, b->n);
+	snprintf(path, NAME_SZ, "%s/mixed/t%d", b->dir, w->id);
+	mkdir(path, 0755);
+	memset(buf, w->id, sizeof(buf));
+	for (int i = 0; i < b->n; ++i)
+	{
+		int dice = next_rand(&seed) % 10;
+		int k = created ? (int)(next_rand(&seed) % created) : 0;
+		long t = now_ns();
+		int ok;
+
+		// 还没有文件时先新建
+		if (created == 0)
+			dice = 4;
+		if (dice < 4)
+		{
+			if (dice < 2)
+				snprintf(path, NAME_SZ, "%s/mixed", b->dir);
+			else
+				snprintf(path, NAME_SZ, "%s/mixed/t%d/f%d", b->dir, w->id, k);
+			ok = stat(path, &st) == 0;
+		}
+		else if (dice < 6)
+		{
+			snprintf(path, NAME_SZ, "%s/mixed/t%d/f%d", b->dir, w->id, created++);
+			int fd = open(path, O_CREAT | O_WRONLY, 0644);
+			ok = fd >= 0;
+			if (fd >= 0)
+				close(fd);
+		}
+		else
+		{
+			snprintf(path, NAME_SZ, "%s/mixed/t%d/f%d", b->dir, w->id, k);
+			int fd = open(path, dice < 8 ? O_WRONLY : O_RDONLY);
+			ok = fd >= 0;
+			if (fd >= 0)
+			{
+				off_t off = (off_t)(next_rand(&seed) % 16) * sizeof(buf);
+				if (dice < 8)
+					ok = pwrite(fd, buf, sizeof(buf), off) == sizeof(buf);
+				else
+					ok = pread(fd, buf, sizeof(buf), off) >= 0;
+				close(fd);
+			}
+		}
+		lat_add(&w->lat, t, ok);
+	}
+	return NULL;
+}
+
+static void run_mixed(struct bench* b, struct lat* l)
+{
+	char path[NAME_SZ];
+	pthread_t* th = (pthread_t*)malloc(b->threads * sizeof(pthread_t));
+	struct worker* ws = (struct worker*)calloc(b->threads, sizeof(struct worker));
+
+	snprintf(path, NAME_SZ, "%s/mixed", b->dir);
+	mkdir(path, 0755);
+	for (int i = 0; i < b->threads; ++i)
+	{
+		ws[i].b = b;
+		ws[i].id = i;
+		pthread_create(th + i, NULL, mixed_worker, ws + i);
+	}
+	for (int i = 0; i < b->threads; ++i)
+	{
+		pthread_join(th[i], NULL);
+		memcpy(l->ns + l->cnt, ws[i].lat.ns, ws[i].lat.cnt * sizeof(long));
+		l->cnt += ws[i].lat.cnt;
+		l->errors += ws[i].lat.errors;
+		free(ws[i].lat.ns);
+	}
+	free(ws);
+	free(th);
+}
+
+/******************************************************************************
+* SECTION: 入口
+*******************************************************************************/
+static void usage(const char* prog)
+{
+	fprintf(stderr, "usage: %s [-n N] [-d depth] [-b bs] [-S size] [-t threads] [-r rounds] [-R seed] [-s stats] "
+			"<create|stat|readdir|seqwrite|seqread|randwrite|randread|mixed> <dir>\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+	struct bench b = { NULL, NULL, NULL, 1000, 0, 4096, 16 << 20, 4, 10, 1 };
+	char stats[NAME_SZ];
+	struct dev_cnt before, after;
+	struct lat l;
+	int has_dev, opt, cap;
+	long start, ns;
+
+	while ((opt = getopt(argc, argv, "n:d:b:S:t:r:R:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': b.n = atoi(optarg); break;
+		case 'd': b.depth = atoi(optarg); break;
+		case 'b': b.bs = parse_size(optarg); break;
+		case 'S': b.size = parse_size(optarg); break;
+		case 't': b.threads = atoi(optarg); break;
+		case 'r': b.rounds = atoi(optarg); break;
+		case 'R': b.seed = strtoul(optarg, NULL, 0); break;
+		case 's': b.stats = optarg; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 2 || b.n <= 0 || b.depth < 0 || b.bs <= 0 || b.threads <= 0 || b.rounds <= 0 || b.seed == 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	b.workload = argv[optind];
+	b.dir = argv[optind + 1];
+	if (b.stats == NULL)
+	{
+		snprintf(stats, NAME_SZ, "%s/.newfs_stats", b.dir);
+		b.stats = stats;
+	}
+
+	cap = b.n * b.threads + (int)(b.size / b.bs) + b.rounds * (b.depth + 1);
+	lat_init(&l, cap);
+	has_dev = dev_read_cnt(b.stats, &before) == 0;
+	start = now_ns();
+	if (!strcmp(b.workload, "create"))
+		run_create(&b, &l);
+	else if (!strcmp(b.workload, "stat"))
+		run_stat(&b, &l);
+	else if (!strcmp(b.workload, "readdir"))
+		run_readdir(&b, &l);
+	else if (!strcmp(b.workload, "seqwrite") || !strcmp(b.workload, "seqread"))
+		run_data(&b, &l, b.workload[3] == 'w', 0);
+	else if (!strcmp(b.workload, "randwrite") || !strcmp(b.workload, "randread"))
+		run_data(&b, &l, b.workload[4] == 'w', 1);
+	else if (!strcmp(b.workload, "mixed"))
+		run_mixed(&b, &l);
+	else
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	ns = now_ns() - start;
+	has_dev = has_dev && dev_read_cnt(b.stats, &after) == 0;
+
+	qsort(l.ns, l.cnt, sizeof(long), long_cmp);
+	printf("{\"workload\":\"%s\",\"tree\":\"%s\",\"depth\":%d,\"n\":%d,\"threads\":%d,\"bs\":%ld,\"size\":%ld,"
+		   "\"ops\":%d,\"errors\":%d,\"secs\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+		   "\"p50_us\":%.1f,\"p99_us\":%.1f,",
+		   b.workload, b.depth ? "deep" : "flat", b.depth, b.n, !strcmp(b.workload, "mixed") ? b.threads : 1,
+		   b.bs, b.size, l.cnt, l.errors, ns / 1e9, ns ? l.cnt * 1e9 / ns : 0,
+		   !strncmp(b.workload, "seq", 3) || !strncmp(b.workload, "rand", 4) ? l.cnt * (double)b.bs / 1048576 * 1e9 / (ns ? ns : 1) : 0,
+		   quantile_us(&l, 0.5), quantile_us(&l, 0.99));
+	if (has_dev)
+		printf("\"dev_read\":%ld,\"dev_write\":%ld,\"dev_seek\":%ld}\n",
+			   after.read - before.read, after.write - before.write, after.seek - before.seek);
+	else
+		printf("\"dev_read\":null,\"dev_write\":null,\"dev_seek\":null}\n");
+	free(l.ns);
+	return l.errors ? 2 : 0;
+}